@@ -3,6 +3,8 @@
 
 #pragma once
 
+#include "Config.hpp"
+
 #include <cstdint>
 
 constexpr uint64_t TurnWhite = (1ULL << 0);
@@ -10,6 +12,7 @@ constexpr uint64_t CastlingWhiteShort = (1ULL << 1);
 constexpr uint64_t CastlingWhiteLong = (1ULL << 2);
 constexpr uint64_t CastlingBlackShort = (1ULL << 3);
 constexpr uint64_t CastlingBlackLong = (1ULL << 4);
+constexpr uint64_t CastlingAny = CastlingWhiteShort | CastlingWhiteLong | CastlingBlackShort | CastlingBlackLong;
 // Bits 5 - 10 denote the EP square
 constexpr uint64_t EPValid = (1ULL << 11);
 
@@ -23,6 +26,14 @@ struct alignas(64) Position
     uint64_t w = 0xffff000000000000ULL;
     uint64_t state = TurnWhite | CastlingWhiteShort | CastlingWhiteLong | CastlingBlackShort | CastlingBlackLong;
     uint64_t hash = 0;
+#if HASH_SYMMETRY
+    uint64_t hashFlip = 0;   // Hash of the color-flipped position
+    uint64_t hashMirror = 0; // Hash of the left-right mirrored position
+    uint64_t hashFlipMirror = 0; // Hash of the color-flipped and mirrored position
+#endif
+#if HASH_VERIFY
+    uint64_t hash2 = 0;      // Independent second key for verifying hash table hits
+#endif
 };
 
 enum Piece : uint16_t
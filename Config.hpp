@@ -7,4 +7,8 @@
 #define LEAF_NODE_BULK_COUNT 1
 #define HASH_TABLE 0 
 #define COLLECT_STATS 0
-
+#define HASH_SYMMETRY 0
+#define HASH_PACKED_BUCKETS 0
+#define HASH_DEPTH_BANDS 0
+#define HASH_VERIFY 0
+#define SCHEDULER_STATS 0
@@ -2,10 +2,17 @@
 // HashTable.cpp
 
 #include "HashTable.hpp"
+#include "Memory.hpp"
+#include "Stats.hpp"
 
 #include <intrin.h>
 #include <random>
 #include <cstdio>
+#include <cinttypes>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <thread>
 
 #pragma intrinsic(_BitScanForward64)
 
@@ -24,18 +31,84 @@ bool HashEntry::posEqual(const Position& pos)
 #endif
 
 HashTable::Hashes HashTable::hashKeys[64];
+#if HASH_VERIFY
+HashTable::Hashes HashTable::hashKeys2[64];
+#endif
 bool HashTable::hashesReady = false;
 
-HashTable::HashTable(uint32_t sizeExp)
-    : m_size(1 << sizeExp)
-    , m_sizeExp(sizeExp)
+// Header of a saved table. The entries follow it on the next page, in the order they are in
+// memory: the main table and then the depth bands.
+struct HashFileHeader
 {
-#if MULTITHREADED
-    m_hashTable = (std::atomic<HashEntry>*)_aligned_malloc(m_size * sizeof(std::atomic<HashEntry>), 64);
-#else
-    m_hashTable = (HashEntry*)_aligned_malloc(m_size * sizeof(HashEntry), 64);
-#endif
-    clear();
+    char magic[8];
+    uint32_t version;
+    uint32_t format;        // HashFileFormat bits
+    uint32_t entrySize;
+    std::atomic<uint32_t> generation;   // Advanced by every search on a shared table
+    uint64_t seed;
+    uint64_t lines;
+    uint64_t bandLines[2];
+    uint64_t checksum;      // Of the entries
+    char padding[4032];
+};
+static_assert(sizeof(HashFileHeader) == 4096, "The entries must start on a page boundary to be mapped");
+
+constexpr char HashFileMagic[8] = { 'F', 'P', 'H', 'A', 'S', 'H', 0, 0 };
+constexpr uint32_t HashFileVersion = 1;
+
+// Everything that changes the meaning of the bytes in the file
+enum HashFileFormat : uint32_t
+{
+    HashFileXorKeys = 1,    // Lockless entries store the keys XORed with the data
+    HashFilePacked = 2,
+    HashFileBands = 4,
+    HashFileSymmetry = 8,   // Keys are the smallest of the symmetric ones
+    HashFileVerify = 16     // Keys are partly from the second key
+};
+
+constexpr uint32_t hashFileFormat()
+{
+    return (HASH_LOCKLESS ? HashFileXorKeys : 0) |
+        (HASH_PACKED_BUCKETS ? HashFilePacked : 0) |
+        (HASH_DEPTH_BANDS ? HashFileBands : 0) |
+        (HASH_SYMMETRY ? HashFileSymmetry : 0) |
+        (HASH_VERIFY ? HashFileVerify : 0);
+}
+
+static uint64_t checksum(const void* data, size_t bytes)
+{
+    // Four independent lanes to not be bound by the multiply latency
+    const uint64_t* words = static_cast<const uint64_t*>(data);
+    uint64_t lanes[4] = { 1, 2, 3, 4 };
+    for (size_t i = 0; i + 4 <= bytes / sizeof(uint64_t); i += 4)
+    {
+        for (int j = 0; j < 4; ++j)
+        {
+            lanes[j] = (lanes[j] ^ words[i + j]) * 0x9e3779b97f4a7c15ULL;
+            lanes[j] ^= lanes[j] >> 29;
+        }
+    }
+    return lanes[0] ^ (lanes[1] * 3) ^ (lanes[2] * 5) ^ (lanes[3] * 7);
+}
+
+HashTable::HashTable(size_t bytes, NumaPolicy numaPolicy, ReplacementPolicy replacementPolicy, const char* loadPath, const char* sharedName, bool checkLoad)
+    : m_hashTable(nullptr)
+    , m_memory(nullptr)
+    , m_size(0)
+    , m_lines(0)
+    , m_replacementPolicy(replacementPolicy)
+    , m_shared(false)
+    , m_generation(0)
+{
+    if (sharedName)
+    {
+        if (loadPath) printf("The hash table is shared, ignoring %s\n", loadPath);
+        if (!attachShared(sharedName, bytes, numaPolicy)) allocate(bytes, numaPolicy);
+    }
+    else if (!loadPath || !load(loadPath, checkLoad))
+    {
+        allocate(bytes, numaPolicy);
+    }
     if (!hashesReady)
     {
         initHashes();
@@ -43,6 +116,242 @@ HashTable::HashTable(uint32_t sizeExp)
     }
 }
 
+void HashTable::allocate(size_t bytes, NumaPolicy numaPolicy)
+{
+    // Without memory there is no table at all. Nothing is found and nothing is stored.
+    if (!bytes)
+    {
+        m_lines = 0;
+        m_size = 0;
+#if HASH_DEPTH_BANDS
+        for (DepthBand& band : m_bands)
+        {
+            band.entries = nullptr;
+            band.lines = 0;
+        }
+#endif
+        return;
+    }
+
+    setGeometry(bytes);
+
+#if HASH_LOCKLESS
+    m_hashTable = static_cast<AtomicHashEntry*>(allocateLarge(m_size * sizeof(AtomicHashEntry), "Hash table"));
+#else
+    m_hashTable = static_cast<HashEntry*>(allocateLarge(m_size * sizeof(HashEntry), "Hash table"));
+#endif
+    m_memory = m_hashTable;
+#if HASH_DEPTH_BANDS
+    allocateBands(numaPolicy);
+#endif
+    // The fresh pages are already zero. Leaving them untouched lets the workers fault them in on their own nodes.
+    placeOnNodes(numaPolicy);
+}
+
+// The memory budget is shared between the main table and the depth bands
+void HashTable::setGeometry(size_t bytes)
+{
+#if HASH_DEPTH_BANDS
+    uint32_t totalShares = 0;
+    for (uint32_t share : DepthBandShares)
+    {
+        totalShares += share;
+    }
+
+    uint64_t bandLines[NumDepthBands];
+    for (int i = 0; i < NumDepthBands; ++i)
+    {
+        bandLines[i] = bytes / totalShares * DepthBandShares[i + 1] / 64;
+    }
+    setLines(bytes / totalShares * DepthBandShares[0] / 64, bandLines);
+#else
+    setLines(bytes / (4 * sizeof(HashEntry)), nullptr);
+#endif
+}
+
+void HashTable::setLines(uint64_t lines, const uint64_t* bandLines)
+{
+    m_lines = lines ? lines : 1;
+    m_size = 4 * m_lines;
+
+#if HASH_DEPTH_BANDS
+    for (int i = 0; i < NumDepthBands; ++i)
+    {
+        DepthBand& band = m_bands[i];
+        band.lines = bandLines[i] ? bandLines[i] : 1;
+        band.countBits = DepthBandCountBits[i];
+        band.entries = nullptr;
+    }
+#else
+    (void)bandLines;
+#endif
+}
+
+// Point the tables into one block of memory, where they are in the order of a saved file
+void HashTable::setTables(char* entries)
+{
+    m_hashTable = reinterpret_cast<decltype(m_hashTable)>(entries);
+#if HASH_DEPTH_BANDS
+    entries += m_size * sizeof(*m_hashTable);
+    for (DepthBand& band : m_bands)
+    {
+        band.entries = reinterpret_cast<decltype(band.entries)>(entries);
+        entries += band.lines * 64;
+    }
+#endif
+}
+
+uint64_t HashTable::tablesChecksum() const
+{
+    uint64_t sum = checksum(m_hashTable, m_size * sizeof(*m_hashTable));
+#if HASH_DEPTH_BANDS
+    for (int i = 0; i < NumDepthBands; ++i)
+    {
+        sum ^= checksum(m_bands[i].entries, m_bands[i].lines * 64) * (i + 2);
+    }
+#endif
+    return sum;
+}
+
+size_t HashTable::payloadBytes() const
+{
+    size_t bytes = m_size * sizeof(*m_hashTable);
+#if HASH_DEPTH_BANDS
+    for (const DepthBand& band : m_bands)
+    {
+        bytes += band.lines * 64;
+    }
+#endif
+    return bytes;
+}
+
+bool HashTable::save(const char* path)
+{
+    if (!m_lines)
+    {
+        printf("The hash table is disabled, nothing to save to %s\n", path);
+        return false;
+    }
+
+    HashFileHeader header = {};
+    memcpy(header.magic, HashFileMagic, sizeof(header.magic));
+    header.version = HashFileVersion;
+    header.format = hashFileFormat();
+    header.entrySize = sizeof(*m_hashTable);
+    header.generation = m_generation;
+    header.seed = ZobristSeed;
+    header.lines = m_lines;
+
+    header.checksum = tablesChecksum();
+#if HASH_DEPTH_BANDS
+    for (int i = 0; i < NumDepthBands; ++i)
+    {
+        header.bandLines[i] = m_bands[i].lines;
+    }
+#endif
+
+    // The table may be mapped from the file it is saved to, so the file is replaced only
+    // once the new one is complete. That also keeps the old table if the save fails.
+    std::string tmpPath = std::string(path) + ".tmp";
+    FILE* f = nullptr;
+    errno_t err = fopen_s(&f, tmpPath.c_str(), "wb");
+    if (err)
+    {
+        printf("Opening %s for the hash table failed with error code %d\n", tmpPath.c_str(), err);
+        return false;
+    }
+
+    bool success = fwrite(&header, sizeof(header), 1, f) == 1 &&
+        fwrite(m_hashTable, sizeof(*m_hashTable), m_size, f) == m_size;
+#if HASH_DEPTH_BANDS
+    for (const DepthBand& band : m_bands)
+    {
+        success = success && fwrite(band.entries, 64, band.lines, f) == band.lines;
+    }
+#endif
+    success = fclose(f) == 0 && success;
+    success = success && replaceFile(tmpPath.c_str(), path);
+
+    if (!success)
+    {
+        printf("Writing the hash table to %s failed\n", path);
+        remove(tmpPath.c_str());
+    }
+    return success;
+}
+
+// The entries are mapped straight from the file, so a big table is ready immediately and
+// its pages are read as they are needed. Only the optional checksum reads through all of them.
+// The sizes in the header come from the file, so they are checked against it before they are
+// used for anything. Saved tables always have at least one line in every part.
+static bool fitsInFile(const HashFileHeader& header, uint64_t entrySize, uint64_t fileSize)
+{
+    if (fileSize < sizeof(header)) return false;
+    uint64_t available = fileSize - sizeof(header);
+
+    if (!header.lines || header.lines > available / (4 * entrySize)) return false;
+    available -= header.lines * 4 * entrySize;
+#if HASH_DEPTH_BANDS
+    for (uint64_t lines : header.bandLines)
+    {
+        if (!lines || lines > available / 64) return false;
+        available -= lines * 64;
+    }
+#endif
+    return true;
+}
+
+bool HashTable::load(const char* path, bool check)
+{
+    HashFileHeader header;
+    FILE* f = nullptr;
+    if (fopen_s(&f, path, "rb"))
+    {
+        printf("No hash table in %s, starting with an empty one\n", path);
+        return false;
+    }
+    bool success = fread(&header, sizeof(header), 1, f) == 1 && _fseeki64(f, 0, SEEK_END) == 0;
+    uint64_t fileSize = success ? static_cast<uint64_t>(_ftelli64(f)) : 0;
+    fclose(f);
+
+    if (!success || memcmp(header.magic, HashFileMagic, sizeof(header.magic)) || header.version != HashFileVersion)
+    {
+        printf("%s is not a hash table file, starting with an empty one\n", path);
+        return false;
+    }
+    if (header.format != hashFileFormat() || header.entrySize != sizeof(*m_hashTable) || header.seed != ZobristSeed)
+    {
+        printf("The hash table in %s was saved by a differently configured build, starting with an empty one\n", path);
+        return false;
+    }
+
+    if (!fitsInFile(header, sizeof(*m_hashTable), fileSize))
+    {
+        printf("The hash table in %s is truncated or its header is corrupted, starting with an empty one\n", path);
+        return false;
+    }
+    setLines(header.lines, header.bandLines);
+
+    char* payload = static_cast<char*>(mapFile(path, sizeof(header), payloadBytes(), "Hash table"));
+    if (!payload)
+    {
+        printf("Mapping the hash table in %s failed, starting with an empty one\n", path);
+        return false;
+    }
+    setTables(payload);
+
+    if (check && tablesChecksum() != header.checksum)
+    {
+        printf("The hash table in %s is corrupted, starting with an empty one\n", path);
+        freeLarge(payload);
+        return false;
+    }
+    m_memory = payload;
+
+    m_generation = static_cast<uint8_t>(header.generation);
+    return true;
+}
+
 HashTable::~HashTable()
 {
     if (m_hashTable)
@@ -65,21 +374,48 @@ HashTable::~HashTable()
             fclose(f);
         }
 #endif
-        _aligned_free(m_hashTable);
         m_hashTable = nullptr;
     }
+
+    freeLarge(m_memory);
+    m_memory = nullptr;
+#if HASH_DEPTH_BANDS
+    // Bands inside a loaded or shared block are no allocations of their own, so these are skipped
+    for (DepthBand& band : m_bands)
+    {
+        freeLarge(band.entries);
+        band.entries = nullptr;
+    }
+#endif
 }
 
 // Insert an entry to the hash table. The weakest form of atomicity is sufficient for us,
 // because the "wrong" thread writing the result only affects the performance, but not
 // the validity of the results. The collisions are so rare that it doesn't make sense
 // to optimize for them, but to make the common case as fast as possible.
-bool HashTable::insert(const HashEntry& entry)
+bool HashTable::insert(const Position& pos, uint16_t depth, uint64_t count)
+{
+    return insertEntry(HashEntry(pos, depth, count), positionKey(pos));
+}
+
+// The key selects the line, and it differs from the stored one only with HASH_VERIFY
+bool HashTable::insertEntry(const HashEntry& entry, uint64_t key)
 {
-    uint32_t index = mapToIndex(entry.hash);
+    if (!m_lines) return false;
+#if HASH_DEPTH_BANDS
+    if (entry.depth() < FirstBandDepth + NumDepthBands) return insertBand(m_bands[entry.depth() - FirstBandDepth], entry);
+#endif
+#if HASH_PACKED_BUCKETS
+    return insertPacked(entry);
+#endif
+    HashEntry newEntry = entry;
+    newEntry.depth_and_count |= static_cast<uint64_t>(m_generation) << 56;
+
+    uint64_t cacheLineStartIndex = mapToIndex(key);
+    uint64_t index = cacheLineStartIndex + (key & 3);
 
-#if MULTITHREADED
-    HashEntry tableEntry = m_hashTable[index].load(std::memory_order_relaxed);
+#if HASH_LOCKLESS
+    HashEntry tableEntry = m_hashTable[index].load();
 #else
     HashEntry tableEntry = m_hashTable[index];
 #endif
@@ -87,27 +423,25 @@ bool HashTable::insert(const HashEntry& entry)
     if (tableEntry.empty() ||
         (tableEntry.hash == entry.hash && tableEntry.depth() == entry.depth()))
     {
-#if MULTITHREADED
-        // Allows spurious failures
-        return m_hashTable[index].compare_exchange_weak(tableEntry, entry, std::memory_order_relaxed);
+#if HASH_LOCKLESS
+        m_hashTable[index].store(newEntry);
 #else
-        m_hashTable[index] = entry;
-        return true;
+        m_hashTable[index] = newEntry;
 #endif
+        return true;
     }
     else
     {
-        uint32_t cacheLineStartIndex = index & 0xfffffffc;
-
         int bestReplacement = -1;
         int64_t bestScore = 0;
-#if MULTITHREADED
-        HashEntry bestEntry;
+#if COLLECT_STATS
+        HashEntry victim;
+        bool evicted = false;   // Whether the chosen slot holds an entry
 #endif
         for (int i = 0; i < 4; ++i)
         {
-#if MULTITHREADED
-            tableEntry = m_hashTable[cacheLineStartIndex + i].load(std::memory_order_relaxed);
+#if HASH_LOCKLESS
+            tableEntry = m_hashTable[cacheLineStartIndex + i].load();
 #else
             tableEntry = m_hashTable[cacheLineStartIndex + i];
 #endif
@@ -115,20 +449,21 @@ bool HashTable::insert(const HashEntry& entry)
             if (tableEntry.empty()) // First try empty slots
             {
                 bestReplacement = i;
-#if MULTITHREADED
-                bestEntry = tableEntry;
+#if COLLECT_STATS
+                evicted = false;
 #endif
                 break;
             }
             else // Then calculate replacement score
             {
-                int64_t score = replacementPolicy(tableEntry, entry);
+                int64_t score = replacementScore(tableEntry, entry, i, 4);
                 if (score > bestScore)
                 {
                     bestReplacement = i;
                     bestScore = score;
-#if MULTITHREADED
-                    bestEntry = tableEntry;
+#if COLLECT_STATS
+                    victim = tableEntry;
+                    evicted = true;
 #endif
                 }
             }
@@ -136,10 +471,13 @@ bool HashTable::insert(const HashEntry& entry)
 
         if (bestReplacement >= 0)
         {
-#if MULTITHREADED
-            m_hashTable[cacheLineStartIndex + bestReplacement].compare_exchange_weak(bestEntry, entry, std::memory_order_relaxed);
+#if COLLECT_STATS
+            if (evicted) threadStats().hashDepth(entry.depth()).evict(victim.count());
+#endif
+#if HASH_LOCKLESS
+            m_hashTable[cacheLineStartIndex + bestReplacement].store(newEntry);
 #else
-            m_hashTable[cacheLineStartIndex + bestReplacement] = entry;
+            m_hashTable[cacheLineStartIndex + bestReplacement] = newEntry;
 #endif
             return true;
         }
@@ -150,22 +488,50 @@ bool HashTable::insert(const HashEntry& entry)
 
 uint64_t HashTable::find(const Position& pos, uint16_t depth)
 {
-    uint32_t index = mapToIndex(pos.hash);
-    uint32_t cacheLineStartIndex = index & 0xfffffffc;
+    if (!m_lines) return InvalidHashTableEntry;
+
+    uint64_t key = positionKey(pos);
+#if HASH_DEPTH_BANDS
+    if (depth < FirstBandDepth + NumDepthBands) return findBand(m_bands[depth - FirstBandDepth], key);
+#endif
+#if HASH_PACKED_BUCKETS
+    return findPacked(key, depth);
+#endif
+    uint64_t cacheLineStartIndex = mapToIndex(key);
+    uint64_t stored = storedKey(pos);
 
     for (int i = 0; i < 4; ++i)
     {
-#if MULTITHREADED
-        HashEntry entry = m_hashTable[cacheLineStartIndex + i].load(std::memory_order_relaxed);
+#if HASH_LOCKLESS
+        HashEntry entry = m_hashTable[cacheLineStartIndex + i].load();
 #else
         HashEntry entry = m_hashTable[cacheLineStartIndex + i];
 #endif
 
-        if (entry.hash == pos.hash && entry.depth() == depth)
+#if HASH_VERIFY && COLLECT_STATS
+        // Same position key, but the second key says it's another position
+        if (!((entry.hash ^ stored) & 0x00000000ffffffffULL) && entry.hash != stored && entry.depth() == depth)
+        {
+            threadStats().hashVerifyMismatches++;
+        }
+#endif
+
+        if (entry.hash == stored && entry.depth() == depth && !entry.empty())
         {
             uint64_t count = entry.count();
 
-#ifdef HASH_DEBUG
+            // A hit makes the entry current again
+            if (entry.generation() != m_generation)
+            {
+                entry.depth_and_count = (entry.depth_and_count & 0x00ffffffffffffffULL) | (static_cast<uint64_t>(m_generation) << 56);
+#if HASH_LOCKLESS
+                m_hashTable[cacheLineStartIndex + i].store(entry);
+#else
+                m_hashTable[cacheLineStartIndex + i] = entry;
+#endif
+            }
+
+#if defined(HASH_DEBUG) && !HASH_SYMMETRY // The stored position may be a symmetric one
             if (!m_hashTable[cacheLineStartIndex + i].posEqual(pos))
             {
                 const HashEntry& e = m_hashTable[cacheLineStartIndex + i];
@@ -197,24 +563,573 @@ uint64_t HashTable::find(const Position& pos, uint16_t depth)
     return InvalidHashTableEntry;
 }
 
+#if HASH_PACKED_BUCKETS
+static __forceinline __m256i loadWords(const std::atomic<uint64_t>* words)
+{
+    return _mm256_setr_epi64x(
+        static_cast<long long>(words[0].load(std::memory_order_relaxed)), static_cast<long long>(words[1].load(std::memory_order_relaxed)),
+        static_cast<long long>(words[2].load(std::memory_order_relaxed)), static_cast<long long>(words[3].load(std::memory_order_relaxed)));
+}
+
+// Slots whose word carries the tag. The info word is masked out.
+static __forceinline uint32_t matchPacked(__m256i low, __m256i high, uint64_t tag)
+{
+    __m256i wanted = _mm256_set1_epi64x(static_cast<long long>(tag));
+    uint32_t lowMatch = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(_mm256_srli_epi64(low, PackedCountBits), wanted)));
+    uint32_t highMatch = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(_mm256_srli_epi64(high, PackedCountBits), wanted)));
+    return (lowMatch | (highMatch << 4)) & PackedEntryMask;
+}
+
+// Depth and generation of the slots in the info word
+static __forceinline uint64_t packedInfo(uint64_t info, uint32_t slot, uint32_t depth, uint32_t generation, bool wide)
+{
+    info &= ~((15ULL << (4 * slot)) | (15ULL << (28 + 4 * slot)) | (1ULL << (56 + slot)));
+    return info | (static_cast<uint64_t>(depth) << (4 * slot)) |
+        (static_cast<uint64_t>(generation & 15) << (28 + 4 * slot)) | (static_cast<uint64_t>(wide) << (56 + slot));
+}
+
+// Counts and depths that don't fit the packed fields are not stored. Those are only found
+// near the root, where the entries are few and the tree is rarely transposed anyway.
+bool HashTable::insertPacked(const HashEntry& entry)
+{
+    if (entry.count() > PackedMaxCount || entry.depth() > PackedMaxDepth) return false;
+
+    PackedBucket* bucket = packedBucket(entry.hash);
+    uint64_t tag = packedTag(entry.hash, entry.depth());
+    uint64_t count = entry.count();
+    bool wide = count > PackedCountMask;
+
+    __m256i low = loadWords(bucket->words);
+    __m256i high = loadWords(bucket->words + 4);
+    alignas(32) uint64_t loaded[8];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(loaded), low);
+    _mm256_store_si256(reinterpret_cast<__m256i*>(loaded + 4), high);
+    uint64_t info = loaded[PackedInfoWord];
+
+    // The words to write, high half first for a wide count
+    uint64_t words[2];
+    int numWords = 1;
+    if (wide)
+    {
+        words[0] = ((tag ^ PackedHighSalt) << PackedCountBits) | (count >> PackedCountBits);
+        words[1] = ((tag ^ PackedLowSalt) << PackedCountBits) | (count & PackedCountMask);
+        numWords = 2;
+    }
+    else
+    {
+        words[0] = (tag << PackedCountBits) | count;
+    }
+
+    // The count of a position never changes, so a stored entry only needs to be made current.
+    // Also a half of a wide count left over from an earlier write is still correct.
+    uint32_t same[2] = { 0, 0 };
+    uint32_t taken = 0;
+    for (int w = 0; w < numWords; ++w)
+    {
+        same[w] = matchPacked(low, high, words[w] >> PackedCountBits);
+        taken |= same[w] & (0u - same[w]);
+    }
+    if (same[0] && (!wide || same[1]))
+    {
+        touchPacked(bucket, info, taken);
+        return true;
+    }
+
+    for (int w = 0; w < numWords; ++w)
+    {
+        if (same[w]) continue;
+
+        unsigned long slot = 0;
+        uint32_t empty = 0;
+        for (int i = 0; i < PackedBucketEntries; ++i)
+        {
+            if (!loaded[i]) empty |= 1u << i;
+        }
+        empty &= ~taken;
+
+        if (!_BitScanForward64(&slot, empty))
+        {
+            int bestReplacement = -1;
+            int64_t bestScore = 0;
+            for (int i = 0; i < PackedBucketEntries; ++i)
+            {
+                if (taken & (1u << i)) continue;
+
+                // Only the low bits of the generation are stored, so older than 15 searches looks newer
+                uint8_t generation = m_generation - ((m_generation - (info >> (28 + 4 * i))) & 15);
+                // A half of a wide count is worth at least a full word
+                uint64_t tableCount = ((info >> (56 + i)) & 1) ? PackedCountMask + 1 : loaded[i] & PackedCountMask;
+
+                HashEntry tableEntry;
+                tableEntry.depth_and_count = (static_cast<uint64_t>(generation) << 56) |
+                    (((info >> (4 * i)) & 15) << 48) | tableCount;
+                int64_t score = replacementScore(tableEntry, entry, i, PackedBucketEntries);
+                if (score > bestScore)
+                {
+                    bestReplacement = i;
+                    bestScore = score;
+                }
+            }
+
+            if (bestReplacement < 0) return false;
+            slot = bestReplacement;
+#if COLLECT_STATS
+            threadStats().hashDepth(entry.depth()).evict(loaded[slot] & PackedCountMask);
+#endif
+        }
+
+        bucket->words[slot].store(words[w], std::memory_order_relaxed);
+        loaded[slot] = words[w];
+        taken |= 1u << slot;
+    }
+
+    // A racing write to the same line may undo this, which only affects the replacement
+    uint64_t newInfo = info;
+    for (uint32_t slots = taken; slots; slots &= slots - 1)
+    {
+        unsigned long slot = 0;
+        _BitScanForward64(&slot, slots);
+        newInfo = packedInfo(newInfo, slot, entry.depth(), m_generation, wide);
+    }
+    if (newInfo != info) bucket->words[PackedInfoWord].store(newInfo, std::memory_order_relaxed);
+
+    return true;
+}
+
+uint64_t HashTable::findPacked(uint64_t key, uint16_t depth)
+{
+    PackedBucket* bucket = packedBucket(key);
+    uint64_t tag = packedTag(key, depth);
+
+    __m256i low = loadWords(bucket->words);
+    __m256i high = loadWords(bucket->words + 4);
+
+    uint32_t match = matchPacked(low, high, tag);
+    uint32_t highMatch = 0;
+    uint32_t lowMatch = 0;
+    if (!match)
+    {
+        highMatch = matchPacked(low, high, tag ^ PackedHighSalt);
+        if (!highMatch) return InvalidHashTableEntry;
+        lowMatch = matchPacked(low, high, tag ^ PackedLowSalt);
+        if (!lowMatch) return InvalidHashTableEntry;
+    }
+
+    // The count must come from the same load as the tag it was matched with
+    alignas(32) uint64_t loaded[8];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(loaded), low);
+    _mm256_store_si256(reinterpret_cast<__m256i*>(loaded + 4), high);
+    uint64_t info = bucket->words[PackedInfoWord].load(std::memory_order_relaxed);
+
+    unsigned long slot = 0;
+    if (match)
+    {
+        _BitScanForward64(&slot, match);
+        touchPacked(bucket, info, 1u << slot);
+        return loaded[slot] & PackedCountMask;
+    }
+
+    unsigned long lowSlot = 0;
+    _BitScanForward64(&slot, highMatch);
+    _BitScanForward64(&lowSlot, lowMatch);
+    touchPacked(bucket, info, (1u << slot) | (1u << lowSlot));
+    return ((loaded[slot] & PackedCountMask) << PackedCountBits) | (loaded[lowSlot] & PackedCountMask);
+}
+
+// A hit makes the entries current again. A racing write to another slot may undo it.
+void HashTable::touchPacked(PackedBucket* bucket, uint64_t info, uint32_t slots)
+{
+    uint64_t newInfo = info;
+    for (; slots; slots &= slots - 1)
+    {
+        unsigned long slot = 0;
+        _BitScanForward64(&slot, slots);
+        newInfo &= ~(15ULL << (28 + 4 * slot));
+        newInfo |= static_cast<uint64_t>(m_generation & 15) << (28 + 4 * slot);
+    }
+    if (newInfo != info) bucket->words[PackedInfoWord].store(newInfo, std::memory_order_relaxed);
+}
+#endif
+
+#if HASH_DEPTH_BANDS
+void HashTable::allocateBands(NumaPolicy numaPolicy)
+{
+    static const char* names[NumDepthBands] = { "Hash table depth 2", "Hash table depth 3" };
+    for (int i = 0; i < NumDepthBands; ++i)
+    {
+        DepthBand& band = m_bands[i];
+        band.entries = static_cast<decltype(band.entries)>(allocateLarge(band.lines * 64, names[i]));
+
+        // The bands are small enough to just spread over the nodes
+        if (numaPolicy != NumaPolicy::None && numaNodes().size() > 1)
+        {
+            interleaveMemory(band.entries, band.lines * 64);
+        }
+    }
+}
+
+// The lowest fragment bit is always set, so that an empty word never matches
+bool HashTable::insertBand(DepthBand& band, const HashEntry& entry)
+{
+    uint64_t countMask = (1ULL << band.countBits) - 1;
+    if (entry.count() > countMask) return false;
+
+    uint64_t fragment = (entry.hash << band.countBits) | (countMask + 1);
+    uint64_t lineStart = __umulh(entry.hash, band.lines) * 8;
+
+    int bestReplacement = -1;
+    int64_t bestScore = 0;
+#if COLLECT_STATS
+    uint64_t victim = 0;
+#endif
+    for (int i = 0; i < 8; ++i)
+    {
+#if HASH_LOCKLESS
+        uint64_t word = band.entries[lineStart + i].load(std::memory_order_relaxed);
+#else
+        uint64_t word = band.entries[lineStart + i];
+#endif
+        if (!word || (word & ~countMask) == fragment)
+        {
+            bestReplacement = i;
+#if COLLECT_STATS
+            victim = 0;
+#endif
+            break;
+        }
+
+        HashEntry tableEntry;
+        tableEntry.depth_and_count = (static_cast<uint64_t>(m_generation) << 56) | (entry.depth_and_count & 0x00ff000000000000ULL) | (word & countMask);
+        int64_t score = replacementScore(tableEntry, entry, i, 8);
+        if (score > bestScore)
+        {
+            bestReplacement = i;
+            bestScore = score;
+#if COLLECT_STATS
+            victim = word;
+#endif
+        }
+    }
+
+    if (bestReplacement < 0) return false;
+
+#if COLLECT_STATS
+    if (victim) threadStats().hashDepth(entry.depth()).evict(victim & countMask);
+#endif
+#if HASH_LOCKLESS
+    band.entries[lineStart + bestReplacement].store(fragment | entry.count(), std::memory_order_relaxed);
+#else
+    band.entries[lineStart + bestReplacement] = fragment | entry.count();
+#endif
+    return true;
+}
+
+uint64_t HashTable::findBand(DepthBand& band, uint64_t key)
+{
+    uint64_t countMask = (1ULL << band.countBits) - 1;
+    uint64_t fragment = (key << band.countBits) | (countMask + 1);
+    uint64_t lineStart = __umulh(key, band.lines) * 8;
+
+    for (int i = 0; i < 8; ++i)
+    {
+#if HASH_LOCKLESS
+        uint64_t word = band.entries[lineStart + i].load(std::memory_order_relaxed);
+#else
+        uint64_t word = band.entries[lineStart + i];
+#endif
+        if ((word & ~countMask) == fragment)
+        {
+            return word & countMask;
+        }
+    }
+
+    return InvalidHashTableEntry;
+}
+
+#if COLLECT_STATS
+void HashTable::printBandStats()
+{
+    printf("Main table %" PRIu64 "k elements for depth %d and up\n", m_size >> 10, FirstBandDepth + NumDepthBands);
+    for (int i = 0; i < NumDepthBands; ++i)
+    {
+        printf("Depth %d table %" PRIu64 "k elements, %u-bit counts\n", FirstBandDepth + i, m_bands[i].lines * 8 >> 10, m_bands[i].countBits);
+    }
+}
+#endif
+#endif
+
+// Processes sharing the table need the same configuration, which the header tells. The
+// process creating the segment fills in the header and publishes it by writing the magic last.
+bool HashTable::attachShared(const char* name, size_t bytes, NumaPolicy numaPolicy)
+{
+    setGeometry(bytes);
+
+    size_t size = sizeof(HashFileHeader) + payloadBytes();
+    bool created = false;
+    char* base = static_cast<char*>(mapShared(name, size, created, "Hash table"));
+    if (!base)
+    {
+        printf("Attaching to the shared memory %s failed, using a private hash table\n", name);
+        return false;
+    }
+
+    HashFileHeader* header = reinterpret_cast<HashFileHeader*>(base);
+    if (created)
+    {
+        header->version = HashFileVersion;
+        header->format = hashFileFormat();
+        header->entrySize = sizeof(*m_hashTable);
+        header->seed = ZobristSeed;
+        header->generation.store(0, std::memory_order_relaxed);
+        header->lines = m_lines;
+#if HASH_DEPTH_BANDS
+        for (int i = 0; i < NumDepthBands; ++i)
+        {
+            header->bandLines[i] = m_bands[i].lines;
+        }
+#endif
+        setTables(base + sizeof(HashFileHeader));
+        placeOnNodes(numaPolicy);
+
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy(header->magic, HashFileMagic, sizeof(header->magic));
+    }
+    else
+    {
+        // Give the creator a moment to publish the header
+        volatile const char* magic = header->magic;
+        for (int i = 0; i < 1000 && memcmp(const_cast<const char*>(magic), HashFileMagic, sizeof(HashFileMagic)); ++i)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        const char* problem = nullptr;
+        if (memcmp(header->magic, HashFileMagic, sizeof(header->magic)) || header->version != HashFileVersion)
+        {
+            problem = "is not a hash table";
+        }
+        else if (header->format != hashFileFormat() || header->entrySize != sizeof(*m_hashTable) || header->seed != ZobristSeed)
+        {
+            problem = "was created by a differently configured build";
+        }
+        else
+        {
+            setLines(header->lines, header->bandLines);
+            if (sizeof(HashFileHeader) + payloadBytes() > size) problem = "is too small for its hash table";
+        }
+
+        if (problem)
+        {
+            printf("The shared memory %s %s, using a private hash table\n", name, problem);
+            freeLarge(base);
+            return false;
+        }
+        setTables(base + sizeof(HashFileHeader));
+    }
+
+    m_memory = base;
+    m_shared = true;
+    m_generation = static_cast<uint8_t>(header->generation.load(std::memory_order_relaxed));
+    return true;
+}
+
+#if COLLECT_STATS
+// Reads race with the workers, so the numbers are approximate while perft runs
+int HashTable::sampleOccupancy(uint64_t maxLines, OccupancySample* samples) const
+{
+    if (!m_lines) return 0;
+
+    OccupancySample& sample = samples[0];
+    sample = {};
+    sample.lines = maxLines < m_lines ? maxLines : m_lines;
+#if HASH_PACKED_BUCKETS
+    sample.firstDepth = MinHashDepth;
+    sample.lineEntries = PackedBucketEntries;
+    for (uint64_t l = 0; l < sample.lines; ++l)
+    {
+        const PackedBucket* bucket = reinterpret_cast<const PackedBucket*>(&m_hashTable[l * m_lines / sample.lines * 4]);
+        uint64_t info = bucket->words[PackedInfoWord].load(std::memory_order_relaxed);
+        uint32_t used = 0;
+        for (int i = 0; i < PackedBucketEntries; ++i)
+        {
+            if (!bucket->words[i].load(std::memory_order_relaxed)) continue;
+            used++;
+            sample.depthEntries[(info >> (4 * i)) & 15]++;
+        }
+        sample.lineFill[used]++;
+    }
+#else
+    sample.firstDepth = MinHashDepth;
+    sample.lineEntries = 4;
+    for (uint64_t l = 0; l < sample.lines; ++l)
+    {
+        uint64_t lineStart = l * m_lines / sample.lines * 4;
+        uint32_t used = 0;
+        for (int i = 0; i < 4; ++i)
+        {
+#if HASH_LOCKLESS
+            HashEntry entry = m_hashTable[lineStart + i].load();
+#else
+            HashEntry entry = m_hashTable[lineStart + i];
+#endif
+            if (entry.empty()) continue;
+            used++;
+            sample.depthEntries[entry.depth() < MaxStatsDepth ? entry.depth() : MaxStatsDepth - 1]++;
+        }
+        sample.lineFill[used]++;
+    }
+#endif
+#if HASH_DEPTH_BANDS
+    sample.firstDepth = FirstBandDepth + NumDepthBands;
+    for (int b = 0; b < NumDepthBands; ++b)
+    {
+        const DepthBand& band = m_bands[b];
+        OccupancySample& bandSample = samples[1 + b];
+        bandSample = {};
+        bandSample.firstDepth = FirstBandDepth + b;
+        bandSample.lineEntries = 8;
+        bandSample.lines = maxLines < band.lines ? maxLines : band.lines;
+        for (uint64_t l = 0; l < bandSample.lines; ++l)
+        {
+            uint64_t lineStart = l * band.lines / bandSample.lines * 8;
+            uint32_t used = 0;
+            for (int i = 0; i < 8; ++i)
+            {
+#if HASH_LOCKLESS
+                used += band.entries[lineStart + i].load(std::memory_order_relaxed) != 0;
+#else
+                used += band.entries[lineStart + i] != 0;
+#endif
+            }
+            bandSample.lineFill[used]++;
+            bandSample.depthEntries[FirstBandDepth + b] += used;
+        }
+    }
+#endif
+    return NumHashTables;
+}
+#endif
+
 void HashTable::clear()
 {
-    memset(m_hashTable, 0, m_size * sizeof(HashEntry));
+    memset(m_hashTable, 0, m_size * sizeof(*m_hashTable));
+#if HASH_DEPTH_BANDS
+    for (DepthBand& band : m_bands)
+    {
+        memset(band.entries, 0, band.lines * 64);
+    }
+#endif
 }
 
-uint32_t HashTable::mapToIndex(uint64_t hash)
+// Every process sharing the table takes a generation of its own from the header
+void HashTable::nextGeneration()
 {
-    // Just take lowest bits, assuming we have a good hash
-    return static_cast<uint32_t>(hash & (m_size - 1));
+    if (m_shared)
+    {
+        HashFileHeader* header = static_cast<HashFileHeader*>(m_memory);
+        m_generation = static_cast<uint8_t>(header->generation.fetch_add(1, std::memory_order_relaxed) + 1);
+        return;
+    }
+    m_generation++;
 }
 
-int64_t HashTable::replacementPolicy(const HashEntry& currentEntry, const HashEntry& candidateEntry)
+// Must be called before the table is touched for the first time
+void HashTable::placeOnNodes(NumaPolicy numaPolicy)
 {
-    // Simplest possible
-    return static_cast<int64_t>(candidateEntry.count()) - static_cast<int64_t>(currentEntry.count());
+    uint32_t numNodes = static_cast<uint32_t>(numaNodes().size());
+    if (numNodes < 2 || numaPolicy == NumaPolicy::None) return;
+
+    // Policies apply to whole pages, which may be huge ones, and the table may start after a
+    // header. The range is widened to the pages it touches, which all belong to the same mapping.
+    uint64_t pageBytes = allocationPageBytes(m_hashTable);
+    uint64_t first = reinterpret_cast<uintptr_t>(m_hashTable);
+    uint64_t bytes = m_size * sizeof(*m_hashTable);
+    uint64_t begin = first & ~(pageBytes - 1);
+    uint64_t end = (first + bytes + pageBytes - 1) & ~(pageBytes - 1);
+
+    // The high bits of the key select the line, so a contiguous slice of the table is also
+    // a range of keys. Every node needs at least a page of its own.
+    bool success = false;
+    if (numaPolicy == NumaPolicy::Partition)
+    {
+        if (end - begin >= numNodes * pageBytes)
+        {
+            success = true;
+            for (uint32_t i = 0; i < numNodes && success; ++i)
+            {
+                uint64_t start = i ? (first + bytes * i / numNodes) & ~(pageBytes - 1) : begin;
+                uint64_t stop = i + 1 < numNodes ? (first + bytes * (i + 1) / numNodes) & ~(pageBytes - 1) : end;
+                success = stop > start && bindMemoryToNode(reinterpret_cast<void*>(start), stop - start, i);
+            }
+        }
+        if (!success)
+        {
+            printf("Partitioning the hash table over %u NUMA nodes failed, interleaving it instead\n", numNodes);
+        }
+    }
+
+    // Interleaving also replaces the policy of any slice that was already bound
+    if (!success)
+    {
+        success = interleaveMemory(reinterpret_cast<void*>(begin), end - begin);
+    }
+
+    if (!success)
+    {
+        printf("Placing the hash table on NUMA nodes failed, pages are placed by first touch\n");
+    }
+}
+
+// The slot with the highest positive score is replaced. Counts stand for the work an entry
+// saves, as they grow roughly with the size of the subtree.
+int64_t HashTable::replacementScore(const HashEntry& currentEntry, const HashEntry& candidateEntry, int slot, int lineEntries)
+{
+    int64_t current = static_cast<int64_t>(currentEntry.count());
+    int64_t candidate = static_cast<int64_t>(candidateEntry.count());
+    uint8_t currentAge = age(currentEntry);
+
+    switch (m_replacementPolicy)
+    {
+    case ReplacementPolicy::TwoTier:
+        if (slot < lineEntries / 2)
+        {
+            // Only deeper entries, or larger ones of the same depth, get into the depth-preferred tier
+            if (candidateEntry.depth() > currentEntry.depth() ||
+                (candidateEntry.depth() == currentEntry.depth() && candidate > current))
+            {
+                return (1LL << 60) - (static_cast<int64_t>(currentEntry.depth()) << 48) - current;
+            }
+            return 0;
+        }
+        return (1LL << 48) - current;
+    case ReplacementPolicy::Aging:
+        return candidate - (currentAge < 48 ? current >> currentAge : 0);
+    case ReplacementPolicy::Generation:
+        if (currentAge) return (1LL << 56) + (static_cast<int64_t>(currentAge) << 48) - current;
+        return candidate - current;
+    default:
+        return candidate - current;
+    }
+}
+
+const char* HashTable::replacementPolicyName(ReplacementPolicy policy)
+{
+    switch (policy)
+    {
+    case ReplacementPolicy::TwoTier: return "twotier";
+    case ReplacementPolicy::Aging: return "aging";
+    case ReplacementPolicy::Generation: return "generation";
+    default: return "count";
+    }
 }
 
 uint64_t HashTable::calcHash(const Position& pos)
+{
+    return calcHash(pos, hashKeys);
+}
+
+uint64_t HashTable::calcHash(const Position& pos, const Hashes* keys)
 {
     uint64_t hash = 0;
     unsigned long sq = 0;
@@ -222,61 +1137,125 @@ uint64_t HashTable::calcHash(const Position& pos)
     uint64_t pcs = pos.p;
     while (_BitScanForward64(&sq, pcs))
     {
-        hash ^= hashKeys[sq].p;
+        hash ^= keys[sq].p;
         pcs ^= (1ULL << sq);
     }
 
     pcs = pos.n;
     while (_BitScanForward64(&sq, pcs))
     {
-        hash ^= hashKeys[sq].n;
+        hash ^= keys[sq].n;
         pcs ^= (1ULL << sq);
     }
 
     pcs = pos.bq & ~pos.rq;
     while (_BitScanForward64(&sq, pcs))
     {
-        hash ^= hashKeys[sq].b;
+        hash ^= keys[sq].b;
         pcs ^= (1ULL << sq);
     }
 
     pcs = pos.rq & ~pos.bq;
     while (_BitScanForward64(&sq, pcs))
     {
-        hash ^= hashKeys[sq].r;
+        hash ^= keys[sq].r;
         pcs ^= (1ULL << sq);
     }
 
     pcs = pos.bq & pos.rq;
     while (_BitScanForward64(&sq, pcs))
     {
-        hash ^= hashKeys[sq].q;
+        hash ^= keys[sq].q;
         pcs ^= (1ULL << sq);
     }
 
     pcs = pos.k;
     while (_BitScanForward64(&sq, pcs))
     {
-        hash ^= hashKeys[sq].k;
+        hash ^= keys[sq].k;
+        pcs ^= (1ULL << sq);
+    }
+
+    pcs = pos.w;
+    while (_BitScanForward64(&sq, pcs))
+    {
+        hash ^= keys[sq].w;
         pcs ^= (1ULL << sq);
     }
 
-    if (pos.state & TurnWhite) hash ^= hashKeys[0].state;
-    if (pos.state & CastlingWhiteShort) hash ^= hashKeys[1].state;
-    if (pos.state & CastlingWhiteLong) hash ^= hashKeys[2].state;
-    if (pos.state & CastlingBlackShort) hash ^= hashKeys[3].state;
-    if (pos.state & CastlingBlackLong) hash ^= hashKeys[4].state;
+    if (pos.state & TurnWhite) hash ^= keys[0].state;
+    if (pos.state & CastlingWhiteShort) hash ^= keys[1].state;
+    if (pos.state & CastlingWhiteLong) hash ^= keys[2].state;
+    if (pos.state & CastlingBlackShort) hash ^= keys[3].state;
+    if (pos.state & CastlingBlackLong) hash ^= keys[4].state;
 
     if (pos.state & EPValid)
     {
         uint64_t EPSquare = (pos.state >> 5) & 63;
-        hash ^= hashKeys[EPSquare].state; // This is OK, because EPSquare is always 16-23 or 40-47
-        hash ^= hashKeys[11].state;
+        hash ^= keys[EPSquare].state; // This is OK, because EPSquare is always 16-23 or 40-47
+        hash ^= keys[11].state;
     }
 
     return hash;
 }
 
+#if HASH_VERIFY
+uint64_t HashTable::calcVerificationHash(const Position& pos)
+{
+    return calcHash(pos, hashKeys2);
+}
+
+// Incremental update of the second key after make(), in the same way as the symmetric keys
+void HashTable::updateVerificationHash(const Position& pos, Position& next)
+{
+    next.hash2 ^= stateHash(pos.state, hashKeys2) ^ stateHash(next.state, hashKeys2);
+
+    uint64_t changed = (pos.p ^ next.p) | (pos.n ^ next.n) | (pos.bq ^ next.bq) | (pos.rq ^ next.rq) | (pos.k ^ next.k) | (pos.w ^ next.w);
+    unsigned long sq = 0;
+    while (_BitScanForward64(&sq, changed))
+    {
+        next.hash2 ^= squareHash(pos, sq, hashKeys2) ^ squareHash(next, sq, hashKeys2);
+        changed ^= (1ULL << sq);
+    }
+}
+
+uint64_t HashTable::squareHash(const Position& pos, unsigned long sq, const Hashes* keys)
+{
+    uint64_t bit = 1ULL << sq;
+    const Hashes& h = keys[sq];
+
+    uint64_t hash = 0;
+    if (pos.p & bit) hash = h.p;
+    else if (pos.n & bit) hash = h.n;
+    else if (pos.bq & pos.rq & bit) hash = h.q;
+    else if (pos.bq & bit) hash = h.b;
+    else if (pos.rq & bit) hash = h.r;
+    else if (pos.k & bit) hash = h.k;
+    else return 0;
+
+    if (pos.w & bit) hash ^= h.w;
+
+    return hash;
+}
+
+uint64_t HashTable::stateHash(uint64_t state, const Hashes* keys)
+{
+    uint64_t hash = 0;
+    if (state & TurnWhite) hash ^= keys[0].state;
+    if (state & CastlingWhiteShort) hash ^= keys[1].state;
+    if (state & CastlingWhiteLong) hash ^= keys[2].state;
+    if (state & CastlingBlackShort) hash ^= keys[3].state;
+    if (state & CastlingBlackLong) hash ^= keys[4].state;
+
+    if (state & EPValid)
+    {
+        hash ^= keys[(state >> 5) & 63].state;
+        hash ^= keys[11].state;
+    }
+    return hash;
+}
+#endif
+
 uint64_t HashTable::hashCastling(uint64_t oldState, uint64_t newState)
 {
     assert(hashesReady);
@@ -306,9 +1285,205 @@ uint64_t HashTable::hashEP(uint64_t oldState, uint64_t newState)
     return hash;
 }
 
+// The hash make() would give to the child, computed without making the move. This follows
+// make() except that the EP square is kept whenever an enemy pawn is next to the pushed pawn,
+// without checking for pins. That rarely differs, and a wrong key only wastes a prefetch.
+uint64_t HashTable::childKey(const Position& pos, const Move& move)
+{
+    const Hashes& srcHash = hashKeys[move.src()];
+    const Hashes& dstHash = hashKeys[move.dst()];
+    uint64_t dst = 1ULL << move.dst();
+    bool white = (pos.state & TurnWhite) != 0;
+    Piece piece = move.piece();
+
+    uint64_t hash = pos.hash ^ hashKeys[0].state;
+
+    // Capture
+    if (pos.p & dst) hash ^= dstHash.p;
+    if (pos.n & dst) hash ^= dstHash.n;
+    if (pos.bq & ~pos.rq & dst) hash ^= dstHash.b;
+    if (pos.rq & ~pos.bq & dst) hash ^= dstHash.r;
+    if (pos.bq & pos.rq & dst) hash ^= dstHash.q;
+    if (!white && (pos.w & dst)) hash ^= dstHash.w;
+
+    // Move piece
+    if (white) hash ^= srcHash.w ^ dstHash.w;
+    hash ^= pieceHash(srcHash, piece);
+    hash ^= pieceHash(dstHash, move.prom() ? move.prom() : piece);
+
+    uint64_t state = pos.state & 0xfffffffffffff01f;
+
+    if (piece == Pawn)
+    {
+        uint64_t EPSquare = (pos.state >> 5) & 63;
+        if ((pos.state & EPValid) && move.dst() == EPSquare)
+        {
+            if (white)
+            {
+                hash ^= hashKeys[EPSquare + 8].p;
+            }
+            else
+            {
+                hash ^= hashKeys[EPSquare - 8].p;
+                hash ^= hashKeys[EPSquare - 8].w;
+            }
+        }
+
+        if ((move.src() ^ move.dst()) == 16)
+        {
+            uint64_t their = white ? pos.p & ~pos.w : pos.p & pos.w;
+            uint64_t neighbours = ((dst << 1) & ~0x0101010101010101ULL) | ((dst >> 1) & ~0x8080808080808080ULL);
+            if (neighbours & their)
+            {
+                state |= (static_cast<uint64_t>((move.src() + move.dst()) >> 1) + 64) << 5;
+            }
+        }
+    }
+    else if (piece == Rook)
+    {
+        if (move.src() == 63) state &= ~CastlingWhiteShort;
+        if (move.src() == 56) state &= ~CastlingWhiteLong;
+        if (move.src() == 7) state &= ~CastlingBlackShort;
+        if (move.src() == 0) state &= ~CastlingBlackLong;
+    }
+    else if (piece == King)
+    {
+        state &= white ? ~(CastlingWhiteShort | CastlingWhiteLong) : ~(CastlingBlackShort | CastlingBlackLong);
+
+        // Castling rook move
+        if (move.packed == 0x6fbc) hash ^= hashKeys[63].r ^ hashKeys[61].r ^ hashKeys[63].w ^ hashKeys[61].w;
+        else if (move.packed == 0x6ebc) hash ^= hashKeys[56].r ^ hashKeys[59].r ^ hashKeys[56].w ^ hashKeys[59].w;
+        else if (move.packed == 0x6184) hash ^= hashKeys[7].r ^ hashKeys[5].r;
+        else if (move.packed == 0x6084) hash ^= hashKeys[0].r ^ hashKeys[3].r;
+    }
+
+    if (dst & 0x8100000000000081ULL)
+    {
+        if (move.dst() == 0) state &= ~CastlingBlackLong;
+        if (move.dst() == 7) state &= ~CastlingBlackShort;
+        if (move.dst() == 56) state &= ~CastlingWhiteLong;
+        if (move.dst() == 63) state &= ~CastlingWhiteShort;
+    }
+
+    hash ^= hashEP(pos.state, state);
+    hash ^= hashCastling(pos.state, state);
+
+    return hash;
+}
+
+uint64_t HashTable::pieceHash(const Hashes& hashes, Piece piece)
+{
+    switch (piece)
+    {
+    case Pawn: return hashes.p;
+    case Knight: return hashes.n;
+    case Bishop: return hashes.b;
+    case Rook: return hashes.r;
+    case Queen: return hashes.q;
+    case King: return hashes.k;
+    default: return 0;
+    }
+}
+
+#if HASH_SYMMETRY
+uint64_t HashTable::calcHash(const Position& pos, HashVariant variant)
+{
+    uint64_t hash = variantStateHash(pos.state, variant);
+    unsigned long sq = 0;
+
+    uint64_t pcs = pos.p | pos.n | pos.bq | pos.rq | pos.k;
+    while (_BitScanForward64(&sq, pcs))
+    {
+        hash ^= variantSquareHash(pos, sq, variant);
+        pcs ^= (1ULL << sq);
+    }
+
+    return hash;
+}
+
+// Incremental update of the symmetric hashes after make(). Only the few squares touched
+// by the move are rehashed, which covers captures, promotions, EP and castling alike.
+void HashTable::updateSymmetricHashes(const Position& pos, Position& next)
+{
+    next.hashFlip ^= variantStateHash(pos.state, HashVariant::Flip) ^ variantStateHash(next.state, HashVariant::Flip);
+    next.hashMirror ^= variantStateHash(pos.state, HashVariant::Mirror) ^ variantStateHash(next.state, HashVariant::Mirror);
+    next.hashFlipMirror ^= variantStateHash(pos.state, HashVariant::FlipMirror) ^ variantStateHash(next.state, HashVariant::FlipMirror);
+
+    uint64_t changed = (pos.p ^ next.p) | (pos.n ^ next.n) | (pos.bq ^ next.bq) | (pos.rq ^ next.rq) | (pos.k ^ next.k) | (pos.w ^ next.w);
+    unsigned long sq = 0;
+    while (_BitScanForward64(&sq, changed))
+    {
+        next.hashFlip ^= variantSquareHash(pos, sq, HashVariant::Flip) ^ variantSquareHash(next, sq, HashVariant::Flip);
+        next.hashMirror ^= variantSquareHash(pos, sq, HashVariant::Mirror) ^ variantSquareHash(next, sq, HashVariant::Mirror);
+        next.hashFlipMirror ^= variantSquareHash(pos, sq, HashVariant::FlipMirror) ^ variantSquareHash(next, sq, HashVariant::FlipMirror);
+        changed ^= (1ULL << sq);
+    }
+}
+
+static unsigned long variantSquare(unsigned long sq, HashVariant variant)
+{
+    switch (variant)
+    {
+    case HashVariant::Flip: return sq ^ 56;
+    case HashVariant::Mirror: return sq ^ 7;
+    default: return sq ^ 63;
+    }
+}
+
+// The hash the piece on the square would contribute to the flipped or mirrored position
+uint64_t HashTable::variantSquareHash(const Position& pos, unsigned long sq, HashVariant variant)
+{
+    uint64_t bit = 1ULL << sq;
+    const Hashes& h = hashKeys[variantSquare(sq, variant)];
+
+    uint64_t hash = 0;
+    if (pos.p & bit) hash = h.p;
+    else if (pos.n & bit) hash = h.n;
+    else if (pos.bq & pos.rq & bit) hash = h.q;
+    else if (pos.bq & bit) hash = h.b;
+    else if (pos.rq & bit) hash = h.r;
+    else if (pos.k & bit) hash = h.k;
+    else return 0;
+
+    // Flipping swaps the colors
+    bool white = (pos.w & bit) != 0;
+    if (white != (variant != HashVariant::Mirror)) hash ^= h.w;
+
+    return hash;
+}
+
+uint64_t HashTable::variantStateHash(uint64_t state, HashVariant variant)
+{
+    uint64_t hash = 0;
+
+    if (variant == HashVariant::Flip)
+    {
+        if (!(state & TurnWhite)) hash ^= hashKeys[0].state;
+        if (state & CastlingWhiteShort) hash ^= hashKeys[3].state;
+        if (state & CastlingWhiteLong) hash ^= hashKeys[4].state;
+        if (state & CastlingBlackShort) hash ^= hashKeys[1].state;
+        if (state & CastlingBlackLong) hash ^= hashKeys[2].state;
+    }
+    else
+    {
+        // Castling rights have no mirror image, and the mirrored hashes are not used while they exist
+        if (((state & TurnWhite) != 0) != (variant == HashVariant::FlipMirror)) hash ^= hashKeys[0].state;
+    }
+
+    if (state & EPValid)
+    {
+        uint64_t EPSquare = (state >> 5) & 63;
+        hash ^= hashKeys[variantSquare(static_cast<unsigned long>(EPSquare), variant)].state; // Still 16-23 or 40-47
+        hash ^= hashKeys[11].state;
+    }
+
+    return hash;
+}
+#endif
+
 void HashTable::initHashes()
 {
-    std::mt19937_64 generator(0xacdcabba);
+    std::mt19937_64 generator(ZobristSeed);
 
     for (int i = 0; i < 64; ++i)
     {
@@ -321,4 +1496,19 @@ void HashTable::initHashes()
         hashKeys[i].w = generator();
         hashKeys[i].state = generator();
     }
+
+#if HASH_VERIFY
+    // Continuing the same sequence, so the second key is independent of the first
+    for (int i = 0; i < 64; ++i)
+    {
+        hashKeys2[i].p = generator();
+        hashKeys2[i].n = generator();
+        hashKeys2[i].b = generator();
+        hashKeys2[i].r = generator();
+        hashKeys2[i].q = generator();
+        hashKeys2[i].k = generator();
+        hashKeys2[i].w = generator();
+        hashKeys2[i].state = generator();
+    }
+#endif
 }
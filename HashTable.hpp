@@ -5,14 +5,64 @@
 
 #include "ChessTypes.hpp"
 #include "Config.hpp"
+#include "Topology.hpp"
+#if COLLECT_STATS
+#include "Stats.hpp"
+#endif
 
 #include <cassert>
-#if MULTITHREADED
+#include <immintrin.h>
+#include <intrin.h>
 #include <atomic>
-#endif
 
 //#define HASH_DEBUG
 
+// Entries are stored lockless, so that other threads and processes can share the table,
+// unless they carry the full position for debugging
+#ifdef HASH_DEBUG
+#define HASH_LOCKLESS 0
+#else
+#define HASH_LOCKLESS 1
+#endif
+
+// Key used for probing and storing the position. A color-flipped position has the same
+// perft count, and so do the left-right mirrored ones once all castling rights are gone,
+// so with HASH_SYMMETRY all of them are stored under the smallest of their keys. The mirror
+// of the flip has to be included, or a position and its mirror would take the minimum over
+// different sets of keys.
+__forceinline uint64_t positionKey(const Position& pos)
+{
+#if HASH_SYMMETRY
+    uint64_t key = pos.hash < pos.hashFlip ? pos.hash : pos.hashFlip;
+    if (!(pos.state & CastlingAny))
+    {
+        if (pos.hashMirror < key) key = pos.hashMirror;
+        if (pos.hashFlipMirror < key) key = pos.hashFlipMirror;
+    }
+    return key;
+#else
+    return pos.hash;
+#endif
+}
+
+#if HASH_VERIFY
+#if HASH_SYMMETRY || HASH_PACKED_BUCKETS || HASH_DEPTH_BANDS
+#error "HASH_VERIFY needs the full entries and doesn't have symmetric keys"
+#endif
+#endif
+
+// Key stored in the entry. The line is selected by the high bits of the position key, so with
+// HASH_VERIFY the low bits are stored together with the high bits of the second key. A false hit
+// then needs both keys to collide: 64 stored bits on top of the bits selecting the line.
+__forceinline uint64_t storedKey(const Position& pos)
+{
+#if HASH_VERIFY
+    return (pos.hash & 0x00000000ffffffffULL) | (pos.hash2 & 0xffffffff00000000ULL);
+#else
+    return positionKey(pos);
+#endif
+}
+
 #ifdef HASH_DEBUG
 struct alignas(64) HashEntry
 #else
@@ -44,8 +94,9 @@ struct alignas(16) HashEntry
         , padding(0)
 #endif
     {}
+    // Bits 56-63 hold the generation, which the table fills in on insert
     HashEntry(const Position& pos, uint16_t depth, uint64_t count)
-        : hash(pos.hash)
+        : hash(storedKey(pos))
         , depth_and_count((static_cast<uint64_t>(depth) << 48) | count)
 #ifdef HASH_DEBUG
         , bqr(pos.bq | pos.rq)
@@ -58,7 +109,8 @@ struct alignas(16) HashEntry
     {}
 
     __forceinline uint64_t count() const { return depth_and_count & 0x0000ffffffffffffULL; }
-    __forceinline uint16_t depth() const { return static_cast<uint16_t>(depth_and_count >> 48); }
+    __forceinline uint16_t depth() const { return static_cast<uint16_t>((depth_and_count >> 48) & 0xff); }
+    __forceinline uint8_t generation() const { return static_cast<uint8_t>(depth_and_count >> 56); }
     __forceinline bool empty() const { return depth_and_count == 0; }
 
 #ifdef HASH_DEBUG
@@ -66,14 +118,124 @@ struct alignas(16) HashEntry
 #endif
 };
 
+#if MULTITHREADED && !HASH_LOCKLESS
+#error "HASH_DEBUG entries can't be stored atomically, use a single threaded build"
+#endif
+
+#if HASH_LOCKLESS
+// Lockless hashing: the key is stored XORed with the data. If two threads write the entry
+// at the same time and the halves get mixed, the key no longer matches and the entry is
+// simply missed. Both halves are plain 8-byte accesses, no locks or 16-byte CAS needed.
+struct alignas(16) AtomicHashEntry
+{
+    std::atomic<uint64_t> key;
+    std::atomic<uint64_t> data;
+
+    __forceinline HashEntry load() const
+    {
+        HashEntry entry;
+        entry.depth_and_count = data.load(std::memory_order_relaxed);
+        entry.hash = key.load(std::memory_order_relaxed) ^ entry.depth_and_count;
+        return entry;
+    }
+
+    __forceinline void store(const HashEntry& entry)
+    {
+        data.store(entry.depth_and_count, std::memory_order_relaxed);
+        key.store(entry.hash ^ entry.depth_and_count, std::memory_order_relaxed);
+    }
+};
+#endif
+
+#if HASH_PACKED_BUCKETS
+#ifdef HASH_DEBUG
+#error "HASH_DEBUG needs the full entries, disable HASH_PACKED_BUCKETS"
+#endif
+
+// Seven entries on a cache line, one 64-bit word each: a 40-bit tag from the low bits of the key
+// with the depth mixed in, and a 24-bit count. The high bits of the key are implied by the line, so
+// over 48 bits of the key are compared in tables of 16 KB or more. A word can't be torn, so no key
+// check is needed, and one AVX2 compare over the shifted words finds the tag. A count too large
+// for a word takes two of them, the high and the low half, each under its own variant of the tag.
+// A position has only one count, so any two halves with the right tags make it up. The last word
+// holds the depths, the low 4 bits of the generations and the wide flags, which only steer the
+// replacement.
+struct alignas(64) PackedBucket
+{
+    std::atomic<uint64_t> words[8];
+};
+static_assert(sizeof(PackedBucket) == 64, "A bucket must fill a cache line");
+
+constexpr int PackedBucketEntries = 7;
+constexpr uint32_t PackedEntryMask = (1u << PackedBucketEntries) - 1;
+constexpr int PackedInfoWord = 7; // Depths in bits 0 - 27, generations in bits 28 - 55, wide flags in bits 56 - 62
+constexpr int PackedCountBits = 24;
+constexpr uint64_t PackedCountMask = (1ULL << PackedCountBits) - 1;
+constexpr uint64_t PackedMaxCount = (1ULL << (2 * PackedCountBits)) - 1;
+constexpr uint64_t PackedTagMask = (1ULL << (64 - PackedCountBits)) - 1;
+constexpr uint64_t PackedHighSalt = 0x5bd1e99537ULL; // Tags of the halves of a wide count
+constexpr uint64_t PackedLowSalt = 0xa3c59ac2f1ULL;
+constexpr uint32_t PackedMaxDepth = 15;
+#endif
+
+#if HASH_DEPTH_BANDS
+// The shallowest depths get tables of their own, where an entry is a single 64-bit word:
+// the low bits of the key shifted up, and a count only as wide as the depth needs. Eight
+// entries fit on a cache line, and a word can't be torn, so no key check is needed.
+constexpr int FirstBandDepth = 2;
+constexpr int NumDepthBands = 2;
+constexpr uint32_t DepthBandCountBits[NumDepthBands] = { 16, 24 }; // At most 218^2 and 218^3
+constexpr uint32_t DepthBandShares[NumDepthBands + 1] = { 1, 2, 1 }; // Memory for the main table and the bands
+
+struct DepthBand
+{
+#if HASH_LOCKLESS
+    std::atomic<uint64_t>* entries;
+#else
+    uint64_t* entries;
+#endif
+    uint64_t lines;
+    uint32_t countBits;
+};
+
+constexpr int NumHashTables = 1 + NumDepthBands;
+#else
+constexpr int NumHashTables = 1;
+#endif
+
 constexpr uint64_t InvalidHashTableEntry = 0xffffffffffffffffULL;
 constexpr int MinHashDepth = 2;
-constexpr uint32_t DefaultHashTableSize = 26;
+constexpr uint32_t DefaultHashTableSize = 26; // As an exponent of 2 entries
+constexpr uint64_t ZobristSeed = 0xacdcabba;
+constexpr int HashPrefetchDistance = 2; // How many children ahead perft prefetches the hash entries
+
+enum class ReplacementPolicy
+{
+    CountDifference,    // Evict the smallest count, if smaller than the new one
+    TwoTier,            // First half of a line prefers depth, the second half always takes the new entry
+    Aging,              // Like CountDifference, but counts from earlier searches halve every search
+    Generation          // Evict entries from earlier searches first, then the smallest count
+};
+
+#if HASH_SYMMETRY
+enum class HashVariant
+{
+    Flip,       // Colors swapped and board flipped vertically
+    Mirror,     // Board mirrored left to right
+    FlipMirror  // Both, which is the board rotated half a turn with the colors swapped
+};
+#endif
 
 class HashTable
 {
 public:
-    HashTable(uint32_t sizeExp);
+    // With a load path, the table is loaded from a file written by save(). With a shared name,
+    // the table is in a named shared memory segment, which is created if no other process has
+    // done it yet. Then bytes is only used for a new segment. If the file or the segment can't
+    // be used, a private empty table is allocated instead. Checking a loaded file reads all of
+    // it at once, instead of the pages being read as they are needed.
+    HashTable(size_t bytes, NumaPolicy numaPolicy = NumaPolicy::None, ReplacementPolicy replacementPolicy = ReplacementPolicy::CountDifference,
+        const char* loadPath = nullptr, const char* sharedName = nullptr, bool checkLoad = false);
     ~HashTable();
 
     HashTable(const HashTable&) = delete;
@@ -81,9 +243,38 @@ public:
     HashTable& operator=(const HashTable&) = delete;
     HashTable& operator=(HashTable&&) = delete;
 
-    bool insert(const HashEntry& entry);
+    bool insert(const Position& pos, uint16_t depth, uint64_t count);
     uint64_t find(const Position& pos, uint16_t depth);
     void clear();
+    bool save(const char* path);
+
+    // Entries stored before this count as older in the replacement
+    void newSearch() { nextGeneration(); }
+
+    uint64_t size() const { return m_size; } // 0 when the table is disabled
+    ReplacementPolicy replacementPolicy() const { return m_replacementPolicy; }
+    static const char* replacementPolicyName(ReplacementPolicy policy);
+#if COLLECT_STATS
+#if HASH_DEPTH_BANDS
+    void printBandStats();
+#endif
+    // Fill evenly spaced lines of each table, at most maxLines of them. Returns the number of tables.
+    int sampleOccupancy(uint64_t maxLines, OccupancySample* samples) const;
+#endif
+    // Start loading the cache line of the key, so that a later find() doesn't stall on memory.
+    // A disabled table prefetches from null, which never faults.
+    __forceinline void prefetch(uint64_t hash, int depth)
+    {
+#if HASH_DEPTH_BANDS
+        if (depth < FirstBandDepth + NumDepthBands)
+        {
+            const DepthBand& band = m_bands[depth - FirstBandDepth];
+            _mm_prefetch(reinterpret_cast<const char*>(&band.entries[__umulh(hash, band.lines) * 8]), _MM_HINT_T0);
+            return;
+        }
+#endif
+        _mm_prefetch(reinterpret_cast<const char*>(&m_hashTable[mapToIndex(hash)]), _MM_HINT_T0);
+    }
 
     struct alignas(64) Hashes
     {
@@ -102,21 +293,90 @@ public:
     static uint64_t hashTurn() { assert(hashesReady); return hashKeys[0].state; }
     static uint64_t hashCastling(uint64_t oldState, uint64_t newState);
     static uint64_t hashEP(uint64_t oldState, uint64_t newState);
+    static uint64_t childKey(const Position& pos, const Move& move);
+#if HASH_VERIFY
+    static uint64_t calcVerificationHash(const Position& pos);
+    static void updateVerificationHash(const Position& pos, Position& next);
+#endif
+#if HASH_SYMMETRY
+    static uint64_t calcHash(const Position& pos, HashVariant variant);
+    static void updateSymmetricHashes(const Position& pos, Position& next);
+#endif
 private:
-    uint32_t mapToIndex(uint64_t hash);
-    int64_t replacementPolicy(const HashEntry& currentEntry, const HashEntry& candidateEntry);
+    // Index of the first entry on the cache line of the key. The high bits of the key select
+    // the line with a multiply (Lemire's fastrange), so any number of lines works, and the
+    // low bits are left for the key fragments of the packed formats.
+    __forceinline uint64_t mapToIndex(uint64_t hash)
+    {
+        return __umulh(hash, m_lines) * 4;
+    }
+
+    static uint64_t pieceHash(const Hashes& hashes, Piece piece);
+    static uint64_t calcHash(const Position& pos, const Hashes* keys);
+#if HASH_VERIFY
+    static uint64_t squareHash(const Position& pos, unsigned long sq, const Hashes* keys);
+    static uint64_t stateHash(uint64_t state, const Hashes* keys);
+#endif
+    bool insertEntry(const HashEntry& entry, uint64_t key);
+#if HASH_PACKED_BUCKETS
+    static __forceinline uint64_t packedTag(uint64_t key, uint16_t depth)
+    {
+        uint64_t tag = (key ^ (depth * 0x9e3779b97fULL)) & PackedTagMask;
+        // No tag, salted or not, may be 0, which is an empty word
+        if (!tag || tag == PackedHighSalt || tag == PackedLowSalt) tag = PackedHighSalt ^ PackedLowSalt;
+        return tag;
+    }
+    __forceinline PackedBucket* packedBucket(uint64_t key)
+    {
+        return reinterpret_cast<PackedBucket*>(&m_hashTable[mapToIndex(key)]);
+    }
+    bool insertPacked(const HashEntry& entry);
+    uint64_t findPacked(uint64_t key, uint16_t depth);
+    void touchPacked(PackedBucket* bucket, uint64_t info, uint32_t slots);
+#endif
+#if HASH_DEPTH_BANDS
+    void allocateBands(NumaPolicy numaPolicy);
+    bool insertBand(DepthBand& band, const HashEntry& entry);
+    uint64_t findBand(DepthBand& band, uint64_t key);
+#endif
+    int64_t replacementScore(const HashEntry& currentEntry, const HashEntry& candidateEntry, int slot, int lineEntries);
+    __forceinline uint8_t age(const HashEntry& entry) const { return static_cast<uint8_t>(m_generation - entry.generation()); }
+    void nextGeneration();
 
     void initHashes();
+    void allocate(size_t bytes, NumaPolicy numaPolicy);
+    void setGeometry(size_t bytes);
+    void setLines(uint64_t lines, const uint64_t* bandLines);
+    void setTables(char* entries);
+    bool load(const char* path, bool check);
+    bool attachShared(const char* name, size_t bytes, NumaPolicy numaPolicy);
+    uint64_t tablesChecksum() const;
+    size_t payloadBytes() const;
+    void placeOnNodes(NumaPolicy numaPolicy);
+#if HASH_SYMMETRY
+    static uint64_t variantSquareHash(const Position& pos, unsigned long sq, HashVariant variant);
+    static uint64_t variantStateHash(uint64_t state, HashVariant variant);
+#endif
 
-#if MULTITHREADED
-    std::atomic<HashEntry>* m_hashTable;
+#if HASH_LOCKLESS
+    AtomicHashEntry* m_hashTable;
 #else
     HashEntry* m_hashTable;
 #endif
-    uint32_t m_size;
-    uint32_t m_sizeExp;
+    void* m_memory;     // Allocation or mapping holding the entries
+    uint64_t m_size;    // Entries
+    uint64_t m_lines;   // Cache lines of four entries
+    ReplacementPolicy m_replacementPolicy;
+    bool m_shared;
+    uint8_t m_generation;
+#if HASH_DEPTH_BANDS
+    DepthBand m_bands[NumDepthBands];
+#endif
     
     static Hashes hashKeys[64];
+#if HASH_VERIFY
+    static Hashes hashKeys2[64];
+#endif
     static bool hashesReady;
 };
 
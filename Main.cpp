@@ -4,6 +4,10 @@
 #include <cstdio>
 #include <cinttypes>
 #include <chrono>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 
 #include "Config.hpp"
 #include "ChessTypes.hpp"
@@ -12,15 +16,15 @@
 #include "Perft.hpp"
 #include "TestPositions.hpp"
 #include "FENParser.hpp"
+#include "HashTable.hpp"
+#include "Memory.hpp"
+#include "Topology.hpp"
+#include "Trace.hpp"
 
 #if COLLECT_STATS
 #include "Stats.hpp"
 #endif
 
-#if HASH_TABLE
-#include "HashTable.hpp"
-#endif
-
 #if HASH_TABLE
 HashTable* hashTable = nullptr;
 #endif
@@ -28,34 +32,65 @@ HashTable* hashTable = nullptr;
 struct PerftParams
 {
     int depth;
-    int hashTableSize;
+    size_t hashTableBytes;
     int numberOfWorkers;
     bool collectStats;
+    NumaPolicy numaPolicy;
+    Affinity affinity;
+#if MULTITHREADED
+    Scheduler scheduler;
+    int frontierDepth;
+#endif
+    ReplacementPolicy replacementPolicy;
+    const char* hashLoadPath;
+    const char* hashSavePath;
+    const char* hashSharedName;
+    bool hashCheck;
+    const char* statsJsonPath;
+    const char* tracePath;
+    uint32_t traceRate;
     Position position;
 };
 
 PerftParams parseCommandLine(int argc, char** argv);
+size_t parseMemorySize(const char* str);
 void printUsage();
-void testPerft(const Position& pos, int depth);
+void testPerft(const PerftParams& params);
 
 int main(int argc, char** argv)
 {       
     PerftParams params = parseCommandLine(argc, argv);
 
+    fillMoveTables();
+
+    normalizeState(params.position);
+
 #if HASH_TABLE
-    hashTable = new HashTable(params.hashTableSize);
+    hashTable = new HashTable(params.hashTableBytes, params.numaPolicy, params.replacementPolicy, params.hashLoadPath, params.hashSharedName, params.hashCheck);
 
     params.position.hash = HashTable::calcHash(params.position);
+#if HASH_SYMMETRY
+    params.position.hashFlip = HashTable::calcHash(params.position, HashVariant::Flip);
+    params.position.hashMirror = HashTable::calcHash(params.position, HashVariant::Mirror);
+    params.position.hashFlipMirror = HashTable::calcHash(params.position, HashVariant::FlipMirror);
+#endif
+#if HASH_VERIFY
+    params.position.hash2 = HashTable::calcVerificationHash(params.position);
+#endif
 #endif
 
-    fillMoveTables();
-    
-    testPerft(params.position, params.depth);
+    testPerft(params);
 
 #if HASH_TABLE
+    if (params.hashSavePath)
+    {
+        hashTable->save(params.hashSavePath);
+    }
     delete hashTable;
 #endif
 
+    releaseMoveTables();
+
     return 0;
 }
 
@@ -64,12 +99,26 @@ PerftParams parseCommandLine(int argc, char** argv)
     PerftParams params;
     params.depth = 1;
 #if HASH_TABLE
-    params.hashTableSize = DefaultHashTableSize;
+    params.hashTableBytes = (1ULL << DefaultHashTableSize) * sizeof(HashEntry);
 #else
-    params.hashTableSize = 0;
+    params.hashTableBytes = 0;
 #endif
-    params.numberOfWorkers = 8;
+    params.numberOfWorkers = 0; // One for each hardware thread
     params.collectStats = false;
+    params.numaPolicy = NumaPolicy::None;
+    params.affinity.policy = AffinityPolicy::None;
+#if MULTITHREADED
+    params.scheduler = Scheduler::ChildStealing;
+    params.frontierDepth = 0;
+#endif
+    params.replacementPolicy = ReplacementPolicy::CountDifference;
+    params.hashLoadPath = nullptr;
+    params.hashSavePath = nullptr;
+    params.hashSharedName = nullptr;
+    params.hashCheck = false;
+    params.statsJsonPath = nullptr;
+    params.tracePath = nullptr;
+    params.traceRate = 1;
     params.position = Position1;
 
     bool failure = false;
@@ -98,7 +147,31 @@ PerftParams parseCommandLine(int argc, char** argv)
                 failure = true;
                 break;
             }
-            params.hashTableSize = atoi(argv[i + 1]);
+            if (atoi(argv[i + 1]) < 0)
+            {
+                params.hashTableBytes = 0;
+            }
+            else if (atoi(argv[i + 1]) >= 64 || (SIZE_MAX >> atoi(argv[i + 1])) < sizeof(HashEntry))
+            {
+                failure = true;
+            }
+            else
+            {
+                params.hashTableBytes = (1ULL << atoi(argv[i + 1])) * sizeof(HashEntry);
+            }
+            ++i;
+            break;
+        case 'H':
+            if (argc <= i + 1)
+            {
+                failure = true;
+                break;
+            }
+            params.hashTableBytes = parseMemorySize(argv[i + 1]);
+            if (!params.hashTableBytes)
+            {
+                failure = true;
+            }
             ++i;
             break;
         case 'w':
@@ -108,11 +181,106 @@ PerftParams parseCommandLine(int argc, char** argv)
                 break;
             }
             params.numberOfWorkers = atoi(argv[i + 1]);
+            if (params.numberOfWorkers < 1)
+            {
+                failure = true;
+            }
+            ++i;
+            break;
+        case 'a':
+            if (argc <= i + 1)
+            {
+                failure = true;
+                break;
+            }
+            if (!parseAffinity(argv[i + 1], params.affinity))
+            {
+                failure = true;
+            }
+            ++i;
+            break;
+#if MULTITHREADED
+        case 'e':
+            if (argc <= i + 1)
+            {
+                failure = true;
+                break;
+            }
+            if (!strcmp(argv[i + 1], "child")) params.scheduler = Scheduler::ChildStealing;
+            else if (!strcmp(argv[i + 1], "continuation")) params.scheduler = Scheduler::ContinuationStealing;
+            else failure = true;
+            ++i;
+            break;
+        case 'p':
+            if (argc <= i + 1)
+            {
+                failure = true;
+                break;
+            }
+            params.frontierDepth = atoi(argv[i + 1]);
+            if (params.frontierDepth < 1)
+            {
+                failure = true;
+            }
             ++i;
             break;
+#endif
         case 's':
             params.collectStats = true;
             break;
+        case 'n':
+            if (argc <= i + 1)
+            {
+                failure = true;
+                break;
+            }
+            if (!strcmp(argv[i + 1], "none")) params.numaPolicy = NumaPolicy::None;
+            else if (!strcmp(argv[i + 1], "interleave")) params.numaPolicy = NumaPolicy::Interleave;
+            else if (!strcmp(argv[i + 1], "partition")) params.numaPolicy = NumaPolicy::Partition;
+            else failure = true;
+            ++i;
+            break;
+        case 'r':
+            if (argc <= i + 1)
+            {
+                failure = true;
+                break;
+            }
+            if (!strcmp(argv[i + 1], "count")) params.replacementPolicy = ReplacementPolicy::CountDifference;
+            else if (!strcmp(argv[i + 1], "twotier")) params.replacementPolicy = ReplacementPolicy::TwoTier;
+            else if (!strcmp(argv[i + 1], "aging")) params.replacementPolicy = ReplacementPolicy::Aging;
+            else if (!strcmp(argv[i + 1], "generation")) params.replacementPolicy = ReplacementPolicy::Generation;
+            else failure = true;
+            ++i;
+            break;
+        case '-':
+            if (!strcmp(argv[i], "--hash-check"))
+            {
+                params.hashCheck = true;
+                break;
+            }
+            if (argc <= i + 1)
+            {
+                failure = true;
+                break;
+            }
+            if (!strcmp(argv[i], "--hash-load")) params.hashLoadPath = argv[i + 1];
+            else if (!strcmp(argv[i], "--hash-save")) params.hashSavePath = argv[i + 1];
+            else if (!strcmp(argv[i], "--hash-shm")) params.hashSharedName = argv[i + 1];
+            else if (!strcmp(argv[i], "--stats-json")) params.statsJsonPath = argv[i + 1];
+            else if (!strcmp(argv[i], "--trace")) params.tracePath = argv[i + 1];
+            else if (!strcmp(argv[i], "--trace-rate"))
+            {
+                int rate = atoi(argv[i + 1]);
+                if (rate <= 0)
+                {
+                    failure = true;
+                }
+                params.traceRate = static_cast<uint32_t>(rate);
+            }
+            else failure = true;
+            ++i;
+            break;
         case 'f':
             if (argc <= i + 1)
             {
@@ -141,6 +309,29 @@ PerftParams parseCommandLine(int argc, char** argv)
     return params;
 }
 
+// Bytes with an optional K, M, G or T suffix, e.g. 48G. Sizes that don't fit are 0.
+size_t parseMemorySize(const char* str)
+{
+    char* end = nullptr;
+    errno = 0;
+    unsigned long long size = strtoull(str, &end, 10);
+    if (end == str || errno == ERANGE || size > SIZE_MAX) return 0;
+
+    int shift = 0;
+    switch (*end)
+    {
+    case '\0': break;
+    case 'k': case 'K': shift = 10; break;
+    case 'm': case 'M': shift = 20; break;
+    case 'g': case 'G': shift = 30; break;
+    case 't': case 'T': shift = 40; break;
+    default: return 0;
+    }
+
+    if (size > (SIZE_MAX >> shift)) return 0;
+    return static_cast<size_t>(size) << shift;
+}
+
 void printUsage()
 {
     printf("Usage:\n");
@@ -150,25 +341,82 @@ void printUsage()
     printf("\t-h <size>       Hash table size as an exponent of 2.\n");
     printf("\t                E.g. -h 20 gives 2 ^ 20 = 1048576 hash table entries.\n");
     printf("\t                Default is 26. Negative value disables hash table.\n");
-    printf("\t-w <workers>    Number of worker threads. Default is 8.\n");
-    printf("\t-s              Print extra stats about moves and hash table.\n");
+    printf("\t-H <bytes>      Hash table memory with an optional K, M, G or T suffix.\n");
+    printf("\t                E.g. -H 48G uses exactly 48 GB.\n");
+    printf("\t-w <workers>    Number of worker threads. Default is one per hardware thread.\n");
+    printf("\t-a <affinity>   Pinning of the workers to CPUs: none, compact, scatter, nosmt\n");
+    printf("\t                or a CPU list such as 0-7,16-23. Default is none.\n");
+    printf("\t-e <engine>     Work stealing scheduler: child or continuation. Default is child.\n");
+    printf("\t-p <depth>      Partition the root: expand it to the depth, merge transpositions\n");
+    printf("\t                and deal the positions to the workers, largest first.\n");
+    printf("\t-s              Print extra stats about moves, hash table, memory pages\n");
+    printf("\t                and the idle and helping time of the workers.\n");
+    printf("\t-n <policy>     NUMA placement of the hash table and workers:\n");
+    printf("\t                none, interleave or partition. Default is none.\n");
+    printf("\t-r <policy>     Hash table replacement: count, twotier, aging or generation.\n");
+    printf("\t                Default is count.\n");
+    printf("\t--hash-load <file>\n");
+    printf("\t                Start with the hash table saved in the file.\n");
+    printf("\t--hash-check    Verify the checksum of the loaded hash table. This reads the\n");
+    printf("\t                whole file at start, instead of as the pages are needed.\n");
+    printf("\t--hash-save <file>\n");
+    printf("\t                Save the hash table to the file at exit.\n");
+    printf("\t--hash-shm <name>\n");
+    printf("\t                Share the hash table with other processes in the named\n");
+    printf("\t                shared memory, e.g. /fastperft.\n");
+    printf("\t--stats-json <file>\n");
+    printf("\t                Write the stats with per-depth hash table counters and\n");
+    printf("\t                occupancy snapshots to the file as JSON. Needs COLLECT_STATS.\n");
+    printf("\t--trace <file>\n");
+    printf("\t                Write a timeline of the work items and waits of each worker\n");
+    printf("\t                to the file as Chrome trace JSON, for Perfetto. Needs MULTITHREADED.\n");
+    printf("\t--trace-rate <n>\n");
+    printf("\t                Trace 1 of every n items and waits of each worker. Default is 1.\n");
     printf("\t-f \"<FEN>\"    Position in FEN notation. Remember to use the quotes.\n");
 }
 
-void testPerft(const Position& pos, int depth)
+void testPerft(const PerftParams& params)
 {
+    const Position& pos = params.position;
+    int depth = params.depth;
+
 #if COLLECT_STATS
     resetStats();
+#else
+    if (params.statsJsonPath)
+    {
+        printf("Stats are not collected in this build, set COLLECT_STATS in Config.hpp for %s\n", params.statsJsonPath);
+    }
 #endif
 
 #if MULTITHREADED
-    initMultiPerft();
+    if (params.tracePath)
+    {
+        startTrace(params.traceRate);
+    }
+    initMultiPerft(params.numberOfWorkers, params.numaPolicy, params.affinity, params.scheduler);
+#else
+    if (params.tracePath)
+    {
+        printf("There are no workers to trace in this build, set MULTITHREADED in Config.hpp for %s\n", params.tracePath);
+    }
 #endif    
 
+#if HASH_TABLE
+    hashTable->newSearch();
+#endif
+
+#if COLLECT_STATS
+    if (params.statsJsonPath)
+    {
+        startStatsSampling();
+    }
+#endif
+
     auto start = std::chrono::high_resolution_clock::now();
 
 #if MULTITHREADED
-    uint64_t count = runMultiPerft(pos, depth);
+    uint64_t count = params.frontierDepth ? runFrontierPerft(pos, depth, params.frontierDepth) : runMultiPerft(pos, depth);
 #else
     Move stack[1024];
     uint64_t count = pos.state & TurnWhite ? perft<White>(pos, depth, stack) : perft<Black>(pos, depth, stack);
@@ -177,15 +425,39 @@ void testPerft(const Position& pos, int depth)
     auto stop = std::chrono::high_resolution_clock::now();
     std::chrono::duration<double> elapsed = stop - start;
 
+#if COLLECT_STATS
+    if (params.statsJsonPath)
+    {
+        stopStatsSampling();
+    }
+#endif
+
     double nps = static_cast<double>(count) / elapsed.count() / 1e6;
 
 #if COLLECT_STATS
     printStats(count);
+    if (params.statsJsonPath)
+    {
+        writeStatsJson(params.statsJsonPath, count, elapsed.count());
+    }
 #else
     printf("Node count = %" PRIu64 " Time %.3f s Speed: %.3f Mnps\n", count, elapsed.count(), nps);
 #endif
 
+    if (params.collectStats)
+    {
+        printAllocationReport();
+    }
+
 #if MULTITHREADED
     releaseMultiPerft();
+    if (params.collectStats || SCHEDULER_STATS)
+    {
+        printWorkerReport();
+    }
+    if (params.tracePath)
+    {
+        writeTrace(params.tracePath);
+    }
 #endif
 }
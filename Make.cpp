@@ -10,8 +10,57 @@
 #include "HashTable.hpp"
 #endif
 
+#include "MoveGeneration.hpp"
+
 #include <immintrin.h>
 
+// Is there an EP capture to EPSquare that doesn't leave the capturing king in check?
+// The side that just made the double pawn move can't be giving any other check than
+// with the pushed pawn or a slider behind it, so testing the sliders is enough.
+static bool legalEPCapture(const Position& pos, unsigned long EPSquare, bool whiteCaptures)
+{
+    unsigned long pawnSq = whiteCaptures ? EPSquare + 8 : EPSquare - 8;
+    uint64_t pawn = 1ULL << pawnSq;
+    uint64_t our = whiteCaptures ? pos.w : ~pos.w;
+    uint64_t capturers = (((pawn << 1) & ~0x0101010101010101ULL) | ((pawn >> 1) & ~0x8080808080808080ULL)) & pos.p & our;
+
+    unsigned long kingSq;
+    if (!_BitScanForward64(&kingSq, pos.k & our)) return capturers != 0;
+
+    uint64_t occ = pos.p | pos.n | pos.bq | pos.rq | pos.k;
+    unsigned long src;
+    while (_BitScanForward64(&src, capturers))
+    {
+        uint64_t occAfter = occ ^ (1ULL << src) ^ pawn ^ (1ULL << EPSquare);
+        if (!(rmoves(kingSq, occAfter) & pos.rq & ~our) && !(bmoves(kingSq, occAfter) & pos.bq & ~our))
+        {
+            return true;
+        }
+        capturers ^= (1ULL << src);
+    }
+
+    return false;
+}
+
+void normalizeState(Position& pos)
+{
+    // Castling rights only when the king and the rook are on their squares
+    uint64_t wk = pos.k & pos.w;
+    uint64_t bk = pos.k & ~pos.w;
+    uint64_t wr = pos.rq & ~pos.bq & pos.w;
+    uint64_t br = pos.rq & ~pos.bq & ~pos.w;
+    if (!(wk & (1ULL << E1)) || !(wr & (1ULL << H1))) pos.state &= ~CastlingWhiteShort;
+    if (!(wk & (1ULL << E1)) || !(wr & (1ULL << A1))) pos.state &= ~CastlingWhiteLong;
+    if (!(bk & (1ULL << E8)) || !(br & (1ULL << H8))) pos.state &= ~CastlingBlackShort;
+    if (!(bk & (1ULL << E8)) || !(br & (1ULL << A8))) pos.state &= ~CastlingBlackLong;
+
+    // EP only when it can be captured
+    if ((pos.state & EPValid) && !legalEPCapture(pos, (pos.state >> 5) & 63, (pos.state & TurnWhite) != 0))
+    {
+        pos.state &= 0xfffffffffffff01f;
+    }
+}
+
 #if !HASH_TABLE && !COLLECT_HASH
 
 Position make(const Position& pos, const Move& move)
@@ -218,7 +267,7 @@ Position make(const Position& pos, const Move& move)
     Piece piece = move.piece();
 
 #if COLLECT_STATS
-    if (dst & (next.p | next.n | next.bq | next.rq)) statsCaptures++;
+    if (dst & (next.p | next.n | next.bq | next.rq)) threadStats().captures++;
 #endif
 
 #if HASH_TABLE    
@@ -321,8 +370,8 @@ Position make(const Position& pos, const Move& move)
                     next.hash ^= HashTable::hashSquare(EPSquare + 8).p;
 #endif
 #if COLLECT_STATS
-                    statsCaptures++;
-                    statsEPs++;
+                    threadStats().captures++;
+                    threadStats().eps++;
 #endif
                 }
                 else
@@ -335,8 +384,8 @@ Position make(const Position& pos, const Move& move)
                     next.hash ^= HashTable::hashSquare(EPSquare - 8).w;
 #endif
 #if COLLECT_STATS
-                    statsCaptures++;
-                    statsEPs++;
+                    threadStats().captures++;
+                    threadStats().eps++;
 #endif
                 }
             }
@@ -358,6 +407,14 @@ Position make(const Position& pos, const Move& move)
                 EPSquare = static_cast<uint64_t>(move.src()) + 8 + 64;
             }
         }
+#if HASH_TABLE
+        // Record EP only when it can be captured, so that the hash doesn't separate positions
+        // that differ only by an EP square nobody can use
+        if (EPSquare && !legalEPCapture(next, static_cast<unsigned long>(EPSquare - 64), !(next.state & TurnWhite)))
+        {
+            EPSquare = 0;
+        }
+#endif
         next.state |= (EPSquare << 5);
     }
 
@@ -442,11 +499,11 @@ Position make(const Position& pos, const Move& move)
                 next.rq ^= mov;
                 next.w ^= mov;
 #if HASH_TABLE
-                next.hash ^= (HashTable::hashSquare(63).r | HashTable::hashSquare(61).r);
-                next.hash ^= (HashTable::hashSquare(63).w | HashTable::hashSquare(61).w);
+                next.hash ^= (HashTable::hashSquare(63).r ^ HashTable::hashSquare(61).r);
+                next.hash ^= (HashTable::hashSquare(63).w ^ HashTable::hashSquare(61).w);
 #endif
 #if COLLECT_STATS
-                statsCastles++;
+                threadStats().castles++;
 #endif
             }
             else if (move.packed == 0x6ebc)
@@ -455,11 +512,11 @@ Position make(const Position& pos, const Move& move)
                 next.rq ^= mov;
                 next.w ^= mov;
 #if HASH_TABLE
-                next.hash ^= (HashTable::hashSquare(56).r | HashTable::hashSquare(59).r);
-                next.hash ^= (HashTable::hashSquare(56).w | HashTable::hashSquare(59).w);
+                next.hash ^= (HashTable::hashSquare(56).r ^ HashTable::hashSquare(59).r);
+                next.hash ^= (HashTable::hashSquare(56).w ^ HashTable::hashSquare(59).w);
 #endif
 #if COLLECT_STATS
-                statsCastles++;
+                threadStats().castles++;
 #endif
             }
         }
@@ -470,10 +527,10 @@ Position make(const Position& pos, const Move& move)
                 mov = 0x00000000000000a0ULL;
                 next.rq ^= mov;
 #if HASH_TABLE
-                next.hash ^= (HashTable::hashSquare(7).r | HashTable::hashSquare(5).r);
+                next.hash ^= (HashTable::hashSquare(7).r ^ HashTable::hashSquare(5).r);
 #endif
 #if COLLECT_STATS
-                statsCastles++;
+                threadStats().castles++;
 #endif
             }
             else if (move.packed == 0x6084)
@@ -481,10 +538,10 @@ Position make(const Position& pos, const Move& move)
                 mov = 0x0000000000000009ULL;
                 next.rq ^= mov;
 #if HASH_TABLE
-                next.hash ^= (HashTable::hashSquare(0).r | HashTable::hashSquare(3).r);
+                next.hash ^= (HashTable::hashSquare(0).r ^ HashTable::hashSquare(3).r);
 #endif
 #if COLLECT_STATS
-                statsCastles++;
+                threadStats().castles++;
 #endif
             }
         }
@@ -509,6 +566,12 @@ Position make(const Position& pos, const Move& move)
 #if HASH_TABLE
     next.hash ^= HashTable::hashTurn();
 #endif
+#if HASH_TABLE && HASH_SYMMETRY
+    HashTable::updateSymmetricHashes(pos, next);
+#endif
+#if HASH_TABLE && HASH_VERIFY
+    HashTable::updateVerificationHash(pos, next);
+#endif
 
     return next;
 }
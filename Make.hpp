@@ -1,8 +1,11 @@
 // Copyright 2022 Samuel Siltanen
-// Make.cpp
+// Make.hpp
 
 #pragma once
 
 #include "ChessTypes.hpp"
 
 Position make(const Position& pos, const Move& move);
+
+// Drop castling rights and EP squares that can't be used, the way make() does
+void normalizeState(Position& pos);
@@ -0,0 +1,331 @@
+// Copyright 2022 Samuel Siltanen
+// Memory.cpp
+
+#include "Memory.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+#endif
+
+constexpr size_t SmallPage = 4096;
+constexpr size_t LargePage2MB = 2 * 1024 * 1024;
+constexpr size_t LargePage1GB = 1024 * 1024 * 1024;
+
+struct Allocation
+{
+    void* ptr;
+    size_t size;
+    PageSize pageSize;
+    const char* name;
+};
+
+static std::vector<Allocation> allocations;
+static std::mutex allocationsLock;
+
+static size_t roundUp(size_t size, size_t alignment)
+{
+    return (size + alignment - 1) & ~(alignment - 1);
+}
+
+#ifdef _WIN32
+// Large pages need the "Lock pages in memory" privilege, which must also be enabled for the process
+static bool enableLargePages()
+{
+    HANDLE token;
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+    {
+        return false;
+    }
+
+    TOKEN_PRIVILEGES tp = {};
+    tp.PrivilegeCount = 1;
+    tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+    bool success = LookupPrivilegeValue(nullptr, SE_LOCK_MEMORY_NAME, &tp.Privileges[0].Luid) &&
+        AdjustTokenPrivileges(token, FALSE, &tp, 0, nullptr, nullptr) &&
+        GetLastError() == ERROR_SUCCESS;
+
+    CloseHandle(token);
+    return success;
+}
+#endif
+
+void* allocateLarge(size_t size, const char* name)
+{
+    void* ptr = nullptr;
+    size_t mappedSize = roundUp(size, SmallPage);
+    PageSize pageSize = PageSize::Small;
+
+#ifdef _WIN32
+    static bool largePagesEnabled = enableLargePages();
+    size_t largePage = GetLargePageMinimum();
+    if (largePagesEnabled && largePage && size >= largePage)
+    {
+        mappedSize = roundUp(size, largePage);
+        ptr = VirtualAlloc(nullptr, mappedSize, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+        if (ptr) pageSize = largePage >= LargePage1GB ? PageSize::Large1GB : PageSize::Large2MB;
+    }
+    if (!ptr)
+    {
+        mappedSize = roundUp(size, SmallPage);
+        ptr = VirtualAlloc(nullptr, mappedSize, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    }
+#else
+    // Explicit huge pages from the preallocated pool first, largest first
+    if (size >= LargePage1GB)
+    {
+        mappedSize = roundUp(size, LargePage1GB);
+        ptr = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_1GB, -1, 0);
+        if (ptr != MAP_FAILED) pageSize = PageSize::Large1GB;
+        else ptr = nullptr;
+    }
+    if (!ptr && size >= LargePage2MB)
+    {
+        mappedSize = roundUp(size, LargePage2MB);
+        ptr = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+        if (ptr != MAP_FAILED) pageSize = PageSize::Large2MB;
+        else ptr = nullptr;
+    }
+
+    // Then ask for transparent huge pages, which the kernel may or may not give
+    if (!ptr)
+    {
+        mappedSize = size >= LargePage2MB ? roundUp(size, LargePage2MB) : roundUp(size, SmallPage);
+        ptr = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED)
+        {
+            ptr = nullptr;
+        }
+#ifdef MADV_HUGEPAGE
+        else if (size >= LargePage2MB && madvise(ptr, mappedSize, MADV_HUGEPAGE) == 0)
+        {
+            pageSize = PageSize::Transparent;
+        }
+#endif
+    }
+#endif
+
+    if (!ptr)
+    {
+        printf("Allocating %zu bytes for %s failed\n", size, name);
+        exit(EXIT_FAILURE);
+    }
+
+    std::lock_guard<std::mutex> guard(allocationsLock);
+    allocations.push_back({ ptr, mappedSize, pageSize, name });
+
+    return ptr;
+}
+
+void* mapFile(const char* path, size_t offset, size_t size, const char* name)
+{
+#ifdef _WIN32
+    // Sharing the delete access lets a later save rename a new file over this one
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) return nullptr;
+
+    LARGE_INTEGER fileSize;
+    HANDLE mapping = nullptr;
+    if (GetFileSizeEx(file, &fileSize) && static_cast<uint64_t>(fileSize.QuadPart) >= offset + size)
+    {
+        mapping = CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+    }
+    CloseHandle(file);
+    if (!mapping) return nullptr;
+
+    // Views must start at the allocation granularity, which is coarser than a page
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    uint64_t start = offset & ~static_cast<uint64_t>(info.dwAllocationGranularity - 1);
+    size_t skip = static_cast<size_t>(offset - start);
+
+    char* view = static_cast<char*>(MapViewOfFile(mapping, FILE_MAP_COPY,
+        static_cast<DWORD>(start >> 32), static_cast<DWORD>(start), skip + size));
+    CloseHandle(mapping); // The view keeps the mapping alive
+    if (!view) return nullptr;
+
+    void* ptr = view + skip;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return nullptr;
+
+    struct stat st;
+    void* ptr = nullptr;
+    if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= offset + size)
+    {
+        ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, offset);
+        if (ptr == MAP_FAILED) ptr = nullptr;
+    }
+    close(fd);
+
+    if (!ptr) return nullptr;
+#endif
+
+    std::lock_guard<std::mutex> guard(allocationsLock);
+    allocations.push_back({ ptr, size, PageSize::File, name });
+
+    return ptr;
+}
+
+bool replaceFile(const char* from, const char* to)
+{
+#ifdef _WIN32
+    return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    return rename(from, to) == 0;
+#endif
+}
+
+void* mapShared(const char* sharedName, size_t& size, bool& created, const char* name)
+{
+    void* ptr = nullptr;
+
+#ifdef _WIN32
+    HANDLE mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+        static_cast<DWORD>(static_cast<uint64_t>(size) >> 32), static_cast<DWORD>(size), sharedName);
+    if (!mapping) return nullptr;
+    created = GetLastError() != ERROR_ALREADY_EXISTS;
+
+    ptr = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    CloseHandle(mapping); // The view keeps the segment alive
+    if (!ptr) return nullptr;
+
+    MEMORY_BASIC_INFORMATION info;
+    if (!created && VirtualQuery(ptr, &info, sizeof(info))) size = info.RegionSize;
+#else
+    int fd = shm_open(sharedName, O_RDWR | O_CREAT | O_EXCL, 0600);
+    created = fd >= 0;
+    if (created)
+    {
+        if (ftruncate(fd, size))
+        {
+            close(fd);
+            shm_unlink(sharedName);
+            return nullptr;
+        }
+    }
+    else
+    {
+        fd = shm_open(sharedName, O_RDWR, 0);
+        if (fd < 0) return nullptr;
+
+        // The creator may not have set the size yet
+        struct stat st = {};
+        for (int i = 0; i < 1000 && fstat(fd, &st) == 0 && st.st_size == 0; ++i)
+        {
+            usleep(1000);
+        }
+        size = static_cast<size_t>(st.st_size);
+    }
+
+    if (size)
+    {
+        ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (ptr == MAP_FAILED) ptr = nullptr;
+    }
+    close(fd);
+    if (!ptr) return nullptr;
+#endif
+
+    std::lock_guard<std::mutex> guard(allocationsLock);
+    allocations.push_back({ ptr, size, PageSize::Shared, name });
+
+    return ptr;
+}
+
+void freeLarge(void* ptr)
+{
+    if (!ptr) return;
+
+    std::lock_guard<std::mutex> guard(allocationsLock);
+    for (size_t i = 0; i < allocations.size(); ++i)
+    {
+        if (allocations[i].ptr == ptr)
+        {
+#ifdef _WIN32
+            if (allocations[i].pageSize == PageSize::Shared || allocations[i].pageSize == PageSize::File)
+            {
+                // A file view may start before the pointer handed out
+                MEMORY_BASIC_INFORMATION info;
+                if (VirtualQuery(ptr, &info, sizeof(info))) UnmapViewOfFile(info.AllocationBase);
+            }
+            else
+            {
+                VirtualFree(ptr, 0, MEM_RELEASE);
+            }
+#else
+            munmap(ptr, allocations[i].size);
+#endif
+            allocations.erase(allocations.begin() + i);
+            return;
+        }
+    }
+}
+
+size_t allocationPageBytes(const void* ptr)
+{
+    const char* p = static_cast<const char*>(ptr);
+
+    std::lock_guard<std::mutex> guard(allocationsLock);
+    for (const Allocation& a : allocations)
+    {
+        const char* start = static_cast<const char*>(a.ptr);
+        if (p < start || p >= start + a.size) continue;
+
+        return a.pageSize == PageSize::Large1GB ? LargePage1GB :
+            a.pageSize == PageSize::Large2MB ? LargePage2MB :
+            SmallPage;
+    }
+    return SmallPage;
+}
+
+void printAllocationReport()
+{
+    std::lock_guard<std::mutex> guard(allocationsLock);
+    for (size_t i = 0; i < allocations.size(); ++i)
+    {
+        const Allocation& a = allocations[i];
+
+        // Allocations with the same name, such as the per-thread stacks, are reported together
+        bool reported = false;
+        size_t count = 0;
+        for (size_t j = 0; j < allocations.size(); ++j)
+        {
+            if (!strcmp(allocations[j].name, a.name) && allocations[j].pageSize == a.pageSize)
+            {
+                if (j < i) reported = true;
+                count++;
+            }
+        }
+        if (reported) continue;
+
+        const char* pageSize =
+            a.pageSize == PageSize::Large1GB ? "1 GB pages" :
+            a.pageSize == PageSize::Large2MB ? "2 MB pages" :
+            a.pageSize == PageSize::Transparent ? "4 kB pages, transparent huge pages requested" :
+            a.pageSize == PageSize::File ? "file pages" :
+            a.pageSize == PageSize::Shared ? "shared memory pages" :
+            "4 kB pages";
+        printf("%s: %zu x %zu kB with %s\n", a.name, count, a.size / 1024, pageSize);
+    }
+}
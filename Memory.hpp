@@ -0,0 +1,40 @@
+// Copyright 2022 Samuel Siltanen
+// Memory.hpp
+
+#pragma once
+
+#include <cstddef>
+
+enum class PageSize
+{
+    Small,          // Regular pages
+    Transparent,    // Regular pages with transparent huge pages requested
+    Large2MB,
+    Large1GB,
+    File,           // Pages of a file mapped copy-on-write
+    Shared          // Named shared memory
+};
+
+// Allocate zeroed memory for large lookup tables, using the largest pages available.
+// The memory is aligned at least to a cache line.
+void* allocateLarge(size_t size, const char* name);
+void freeLarge(void* ptr);
+
+// The size of the pages backing the allocation that contains the address, 4096 if none does
+size_t allocationPageBytes(const void* ptr);
+
+// Map a part of a file copy-on-write, so the pages are read on demand and changes never reach
+// the file. The offset must be a multiple of 4096. Returns nullptr on failure. Free with freeLarge().
+void* mapFile(const char* path, size_t offset, size_t size, const char* name);
+
+// Rename the file over another one, atomically where the OS can. A mapping of the replaced
+// file keeps seeing the old contents.
+bool replaceFile(const char* from, const char* to);
+
+// Map a named shared memory segment. If it doesn't exist, it is created zeroed with the given size.
+// Otherwise size is set to the size of the existing segment. Free with freeLarge(), which leaves
+// the segment to the other processes. On Linux it lives until removed from /dev/shm.
+void* mapShared(const char* sharedName, size_t& size, bool& created, const char* name);
+
+// Print which page size each live allocation actually got
+void printAllocationReport();
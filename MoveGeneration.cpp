@@ -2,6 +2,7 @@
 // MoveGeneration.cpp
 
 #include "MoveGeneration.hpp"
+#include "Memory.hpp"
 
 #include <cstdio>
 #include <intrin.h>
@@ -304,8 +305,9 @@ void calculateMagicNumber(int x, int y)
 uint64_t BMasks[64];
 uint64_t RMasks[64];
 
-uint64_t BAttacks[64][512]; // 512 kB
-uint64_t RAttacks[64][4096]; // 4 MB
+// Both in one allocation, so that they can share large pages
+uint64_t (*BAttacks)[512] = nullptr; // 256 kB
+uint64_t (*RAttacks)[4096] = nullptr; // 2 MB
 #endif
 
 void fillMoveTables()
@@ -521,6 +523,10 @@ void fillMoveTables()
 #endif
 
 #if PEXT_INTRINSIC
+    void* attacks = allocateLarge(sizeof(uint64_t) * 64 * (512 + 4096), "Slider attack tables");
+    BAttacks = static_cast<uint64_t(*)[512]>(attacks);
+    RAttacks = reinterpret_cast<uint64_t(*)[4096]>(BAttacks + 64);
+
     const uint64_t BordersOff = 0x007e7e7e7e7e7e00ULL;
     for (int sq = 0; sq < 64; sq++)
     {
@@ -643,6 +649,15 @@ void fillMoveTables()
 #endif
 }
 
+void releaseMoveTables()
+{
+#if PEXT_INTRINSIC
+    freeLarge(BAttacks);
+    BAttacks = nullptr;
+    RAttacks = nullptr;
+#endif
+}
+
 Move* generateP(const Position& pos, Move* stack, uint64_t occ, const Pins& pins)
 {
     unsigned long src, dst;
@@ -20,6 +20,7 @@ extern Rays rays[64];
 
 // Initialize lookup tables
 void fillMoveTables();
+void releaseMoveTables();
 
 // Move generation, store moves in move stack
 Move* generateP(const Position& pos, Move* stack, uint64_t occ, const Pins& pins);
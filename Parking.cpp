@@ -0,0 +1,47 @@
+// Copyright 2022 Samuel Siltanen
+// Parking.cpp
+
+#include "Parking.hpp"
+
+#include <climits>
+
+#ifdef _WIN32
+#include <windows.h>
+#pragma comment(lib, "Synchronization.lib")
+#else
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+static_assert(sizeof(std::atomic<int>) == sizeof(int), "The word is waited on as a plain int");
+
+void parkWhileEqual(std::atomic<int>& word, int expected)
+{
+#ifdef _WIN32
+    WaitOnAddress(&word, &expected, sizeof(int), INFINITE);
+#else
+    syscall(SYS_futex, reinterpret_cast<int*>(&word), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+#endif
+}
+
+void wakeParked(std::atomic<int>& word, int count)
+{
+#ifdef _WIN32
+    for (int i = 0; i < count; ++i)
+    {
+        WakeByAddressSingle(&word);
+    }
+#else
+    syscall(SYS_futex, reinterpret_cast<int*>(&word), FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+#endif
+}
+
+void wakeAllParked(std::atomic<int>& word)
+{
+#ifdef _WIN32
+    WakeByAddressAll(&word);
+#else
+    wakeParked(word, INT_MAX);
+#endif
+}
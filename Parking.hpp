@@ -0,0 +1,15 @@
+// Copyright 2022 Samuel Siltanen
+// Parking.hpp
+
+#pragma once
+
+#include <atomic>
+
+// Block the calling thread while the word holds the expected value, until another thread wakes
+// it. May also return spuriously, so the caller must check its condition again. Futexes on
+// Linux and WaitOnAddress on Windows, so a parked thread costs nothing until it is woken.
+void parkWhileEqual(std::atomic<int>& word, int expected);
+
+// Wake up to count threads parked on the word
+void wakeParked(std::atomic<int>& word, int count);
+void wakeAllParked(std::atomic<int>& word);
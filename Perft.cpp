@@ -5,69 +5,350 @@
 
 #if MULTITHREADED
 #include "WorkQueue.hpp"
+#include "Memory.hpp"
+#include "Parking.hpp"
+#include "SchedulerStats.hpp"
+#include "Trace.hpp"
 #endif
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
 #include <cassert>
+#include <immintrin.h>
+#include <malloc.h>
+#include <queue>
 #include <random>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #if MULTITHREADED
 
-constexpr size_t MaxWorkQueueSize = 256;
+constexpr size_t InitialWorkQueueSize = 256; // Grows when a worker has more splits pending
 constexpr int MaxMoveStackSize = 1024 * 8;
-constexpr int NumWorkerThreads = 8;
-constexpr int MinWorkItemDepth = 4;
+constexpr int MinSplitDepth = 3;                    // Shallower nodes go to the sequential perft
+constexpr uint64_t MinWorkItemNodes = 1ULL << 20;   // Branches split off even when no one asks for work
+constexpr uint64_t MinStolenItemNodes = 1ULL << 10; // Branches split off for idle workers
+constexpr int SpinRounds = 8;   // Backing off with 1, 2, 4 ... 128 pause instructions
+constexpr int YieldRounds = 16; // Then giving the time slice away, before parking
+constexpr int MaxHelpNesting = 16; // Bounds the recursion of waiting workers helping their thieves
+constexpr int MaxMovesPerNode = 256;
+
+// Set in WorkResult::workLeft when the owner of the split sleeps until it reaches zero
+constexpr int OwnerParked = 1 << 30;
+
+// A node of the continuation stealing engine. The worker that made it descends into its moves
+// one at a time, and the thieves that take it from a queue claim the rest of them the same way.
+// workLeft counts the queue entries of the frame and the thieves working on it.
+struct Frame : WorkResult
+{
+    const Position* pos;
+    const Move* moves;
+    std::atomic<int> next; // The moves below it are still to go
+    int depth;
+};
+
+int numWorkerThreads = 0;
+Scheduler scheduler = Scheduler::ChildStealing;
+std::vector<WorkQueue*> workQueue;
+std::atomic<RunState> runState;
+std::vector<Move*> threadLocalStack;
+std::vector<std::thread*> worker;
+std::vector<WorkerStats> workerStats;
+std::atomic<int> workersReady;
+std::atomic<int> parkedWorkers;
+std::atomic<int> stealRequests; // Workers looking for work
+std::atomic<int> workSignal; // Changed whenever work is pushed while workers are parked
+std::chrono::steady_clock::time_point runStart;
+std::chrono::steady_clock::time_point runEnd;
+thread_local int helpNesting = 0;
+
+// Spin, then yield. Returns false when it is time to park. No stats for the main thread.
+static bool backOff(int& round, WorkerStats* stats)
+{
+    if (round < SpinRounds)
+    {
+        for (int i = 0; i < (1 << round); ++i)
+        {
+            _mm_pause();
+        }
+    }
+    else if (round < SpinRounds + YieldRounds)
+    {
+#if SCHEDULER_STATS
+        auto yieldStart = std::chrono::steady_clock::now();
+        std::this_thread::yield();
+        if (stats) stats->yielding.add(toNanoseconds(std::chrono::steady_clock::now() - yieldStart));
+#else
+        std::this_thread::yield();
+#endif
+    }
+    else
+    {
+        return false;
+    }
+    round++;
+    return true;
+}
 
-WorkQueue* workQueue[NumWorkerThreads];
-RunState runState;
-Move* threadLocalStack[NumWorkerThreads];
-std::thread* worker[NumWorkerThreads];
+// Wake parked workers for the items just pushed
+static void announceWork(int items)
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int parked = parkedWorkers.load(std::memory_order_relaxed);
+    if (parked)
+    {
+        workSignal++;
+        wakeParked(workSignal, std::min(parked, items));
+    }
+}
 
-void worker_loop(int threadIndex)
+static bool steal(int threadIndex, int victim, WorkItem& item)
+{
+#if SCHEDULER_STATS
+    bool lost = false;
+    bool stolen = workQueue[victim]->try_steal_back(item, &lost);
+    countSteal(workerStats[threadIndex], victim, stolen, lost);
+    return stolen;
+#else
+    return workQueue[victim]->try_steal_back(item);
+#endif
+}
+
+static void park(std::atomic<int>& word, int expected, WorkerStats* stats)
+{
+#if SCHEDULER_STATS
+    auto parkStart = std::chrono::steady_clock::now();
+    parkWhileEqual(word, expected);
+    if (stats) stats->parked.add(toNanoseconds(std::chrono::steady_clock::now() - parkStart));
+#else
+    parkWhileEqual(word, expected);
+#endif
+}
+
+// Sleep until work is announced. All queues are looked through once more after registering as
+// parked, so work pushed before the pusher could see this worker parked is not missed.
+static bool parkUntilWork(int threadIndex, WorkItem& item)
+{
+    int signal = workSignal.load();
+    parkedWorkers++;
+
+    bool found = false;
+    for (int i = 1; i < numWorkerThreads && !found; ++i)
+    {
+        found = steal(threadIndex, (threadIndex + i) % numWorkerThreads, item);
+    }
+    if (!found && runState == RunState::Running)
+    {
+        workerStats[threadIndex].parks++;
+        park(workSignal, signal, &workerStats[threadIndex]);
+    }
+
+    parkedWorkers--;
+    return found;
+}
+
+// Identifies the position in the root frontier and in the trace. Without the hash table,
+// make() doesn't maintain pos.hash, so the key is mixed from the board.
+static uint64_t boardKey(const Position& pos)
+{
+#if HASH_TABLE
+    return pos.hash; // make() keeps it equal to HashTable::calcHash()
+#else
+    uint64_t key = pos.state;
+    for (uint64_t bits : { pos.p, pos.n, pos.bq, pos.rq, pos.k, pos.w })
+    {
+        key = (key ^ bits) * 0x9e3779b97f4a7c15ULL;
+    }
+    return key;
+#endif
+}
+
+static uint64_t workOnFrame(Frame& frame, Move* stack, int threadIndex);
+
+// The owner of the split may return as soon as it sees zero, so after the decrement the result
+// is not touched, only the value the decrement returned is looked at
+static void runWorkItem(const WorkItem& item, Move* stack, int threadIndex)
+{
+    WorkResult* result = item.result;
+    uint64_t thief = 1ULL << (threadIndex & 63);
+    result->thieves.fetch_or(thief, std::memory_order_relaxed);
+
+    bool traced = traceEnabled && traceSample();
+    auto traceStart = traced ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+
+    uint64_t count;
+    uint64_t hash = 0;
+    if (scheduler == Scheduler::ContinuationStealing)
+    {
+        count = workOnFrame(*static_cast<Frame*>(result), stack, threadIndex);
+        if (traced) hash = boardKey(*item.parent);
+    }
+    else
+    {
+        Position pos = item.position();
+        count = perftMultithreaded(pos, item.depth, stack, threadIndex);
+        if (traced) hash = boardKey(pos);
+    }
+
+    if (traced)
+    {
+        traceEvent(TraceKind::Item, traceStart, item.depth, hash, count);
+    }
+
+#if SCHEDULER_STATS
+    countItem(workerStats[threadIndex], count);
+#endif
+    result->count += count * item.multiplicity;
+    result->thieves.fetch_and(~thief, std::memory_order_relaxed);
+    if (result->workLeft.fetch_sub(1) - 1 == OwnerParked)
+    {
+        wakeAllParked(result->workLeft);
+    }
+}
+
+// Leapfrogging: a thief works depth first on the item it took, so its queue holds the remaining
+// branches of that item. The owner of the split steals them back instead of sitting idle.
+// With more than 64 workers the bits are shared, which only makes some thieves invisible.
+static bool stealFromThieves(WorkResult& result, int threadIndex, WorkItem& item)
+{
+    uint64_t thieves = result.thieves.load(std::memory_order_relaxed);
+    while (thieves)
+    {
+        unsigned long bit;
+        _BitScanForward64(&bit, thieves);
+        thieves &= thieves - 1;
+
+        for (int i = static_cast<int>(bit); i < numWorkerThreads; i += 64)
+        {
+            if (i != threadIndex && steal(threadIndex, i, item)) return true;
+        }
+    }
+    return false;
+}
+
+// A negative thread index is for the main thread, which only waits. The helping continues on the
+// move stack from where the split left it, because the frames below may still need their moves.
+static void waitForStolenWork(WorkResult& result, Move* stack, int threadIndex)
+{
+    bool canHelp = threadIndex >= 0 && helpNesting < MaxHelpNesting &&
+        stack - threadLocalStack[threadIndex] < MaxMoveStackSize / 2;
+    WorkerStats* stats = threadIndex >= 0 ? &workerStats[threadIndex] : nullptr;
+
+    int round = 0;
+    while (result.workLeft.load() & ~OwnerParked)
+    {
+        WorkItem item;
+        if (canHelp && stealFromThieves(result, threadIndex, item))
+        {
+            auto helpStart = std::chrono::steady_clock::now();
+            helpNesting++;
+            runWorkItem(item, stack, threadIndex);
+            helpNesting--;
+            if (!helpNesting)
+            {
+                stats->helping.add(toNanoseconds(std::chrono::steady_clock::now() - helpStart));
+            }
+            stats->helps++;
+            round = 0;
+            continue;
+        }
+
+        if (backOff(round, stats)) continue;
+
+        int workLeft = result.workLeft.fetch_or(OwnerParked) | OwnerParked;
+        if (workLeft != OwnerParked)
+        {
+            park(result.workLeft, workLeft, stats);
+        }
+    }
+}
+
+void worker_loop(int threadIndex, int cpu, int node)
 {
     std::mt19937 gen(0x12345678 + threadIndex);
-    std::uniform_int_distribution<int> dist(0, NumWorkerThreads - 2);
+    std::uniform_int_distribution<int> dist(0, numWorkerThreads > 1 ? numWorkerThreads - 2 : 0);
+
+    if (cpu >= 0)
+    {
+        if (!pinThreadToCpu(cpu)) printf("Pinning worker %d to CPU %d failed\n", threadIndex, cpu);
+    }
+    else if (node >= 0)
+    {
+        pinThreadToNode(node);
+    }
+
+    // The worker allocates and first touches its own stack and queue, so that they land on its node
+    threadLocalStack[threadIndex] = static_cast<Move*>(allocateLarge(MaxMoveStackSize * sizeof(Move), "Move stack"));
+    memset(threadLocalStack[threadIndex], 0, MaxMoveStackSize * sizeof(Move));
+    workQueue[threadIndex] = new WorkQueue(InitialWorkQueueSize);
+    if (traceEnabled)
+    {
+        registerTraceThread(threadIndex);
+    }
+    workersReady++;
+
+    WorkerStats& stats = workerStats[threadIndex];
+    bool idle = true;
+    stealRequests++;
+    std::chrono::steady_clock::time_point idleSince;
+    int round = 0;
 
     while (runState != RunState::Exiting)
     {
         if (runState == RunState::Initializing)
         {
             std::this_thread::yield();
+            idleSince = std::chrono::steady_clock::now();
             continue;
         }
 
         WorkItem item;
-        if (workQueue[threadIndex]->try_pop_front(item))
+        bool found = workQueue[threadIndex]->try_pop_front(item);
+        if (!found)
         {
-            item.result->count += perftMultithreaded(item.pos, item.depth, threadLocalStack[threadIndex], threadIndex);
-            item.result->workLeft--;
-        }
-        else
-        {
-
             int stealIndex = dist(gen);
             if (stealIndex >= threadIndex) stealIndex++;
 
-            if (workQueue[stealIndex]->try_pop_front(item))
-            {
-                item.result->count += perftMultithreaded(item.pos, item.depth, threadLocalStack[threadIndex], threadIndex);
-                item.result->workLeft--;
-            }
-            else
+            // A lone worker has no one to steal from
+            found = stealIndex < numWorkerThreads && steal(threadIndex, stealIndex, item);
+        }
 
+        if (!found)
+        {
+            if (!idle)
             {
-                std::this_thread::yield();
+                idle = true;
+                idleSince = std::chrono::steady_clock::now();
+                stealRequests++;
             }
+            if (backOff(round, &stats) || !parkUntilWork(threadIndex, item)) continue;
+        }
+
+        if (idle)
+        {
+            stats.idle.add(toNanoseconds(std::chrono::steady_clock::now() - idleSince));
+            idle = false;
+            stealRequests--;
         }
+        round = 0;
+        runWorkItem(item, threadLocalStack[threadIndex], threadIndex);
+    }
+
+    // Idling after the search ended doesn't count
+    if (idle && idleSince < runEnd)
+    {
+        stats.idle.add(toNanoseconds(runEnd - idleSince));
     }
 }
 
-uint64_t perftMultithreaded(const Position& pos, int depth, Move* stack, int threadIndex)
+static Move* generateMoves(const Position& pos, Move* stack)
 {
     const Move* stack0 = stack;
 
-#if !LEAF_NODE_BULK_COUNT
-    if (depth == 0) return 1;
-#endif
-
     uint64_t occ = pos.p | pos.n | pos.bq | pos.rq | pos.k;
 
     Pins pins;
@@ -81,7 +362,7 @@ uint64_t perftMultithreaded(const Position& pos, int depth, Move* stack, int thr
         if (stack == stack0)
         {
 #if COLLECT_STATS
-            statsCheckmates++;
+            threadStats().checkmates++;
 #endif
         }
     }
@@ -96,6 +377,55 @@ uint64_t perftMultithreaded(const Position& pos, int depth, Move* stack, int thr
         stack = generateCastling(pos, stack, occ, pArea);
     }
 
+    return stack;
+}
+
+// The subtree of a child is estimated from the branching factor of its parent
+static uint64_t estimateNodes(int branching, int depth)
+{
+    uint64_t nodes = 1;
+    for (int i = 0; i < depth && nodes < MinWorkItemNodes; ++i)
+    {
+        nodes *= branching;
+    }
+    return nodes;
+}
+
+// Lazy binary splitting: branches are split off only when the queue has run dry, so that there
+// is always something to steal, but not much more. Small branches only when someone is asking.
+static bool shouldSplit(int threadIndex, uint64_t childNodes)
+{
+    if (numWorkerThreads < 2 || childNodes < MinStolenItemNodes || !workQueue[threadIndex]->empty()) return false;
+    return childNodes >= MinWorkItemNodes || stealRequests.load(std::memory_order_relaxed) > 0;
+}
+
+uint64_t perftMultithreaded(const Position& pos, int depth, Move* stack, int threadIndex)
+{
+    Move* stack0 = stack;
+
+#if !LEAF_NODE_BULK_COUNT
+    if (depth == 0) return 1;
+#endif
+
+#if HASH_TABLE
+    if (depth >= MinHashDepth)
+    {
+        uint64_t entry = hashTable->find(pos, depth);
+#if COLLECT_STATS
+        threadStats().hashDepth(depth).probes++;
+#endif
+        if (entry != InvalidHashTableEntry)
+        {
+#if COLLECT_STATS
+            threadStats().hashDepth(depth).hits++;
+#endif
+            return entry;
+        }
+    }
+#endif
+
+    stack = generateMoves(pos, stack);
+
 #if LEAF_NODE_BULK_COUNT
     if (depth == 1)
     {
@@ -104,104 +434,552 @@ uint64_t perftMultithreaded(const Position& pos, int depth, Move* stack, int thr
     else
 #endif
     {
-        if (depth > MinWorkItemDepth)
+        WorkResult result = { 0, 0, 0 };
+        int64_t marker = workQueue[threadIndex]->marker();
+        uint64_t childNodes = estimateNodes(static_cast<int>(stack - stack0), depth - 1);
+        uint64_t count = 0;
+
+        // The moves in [first, stack) are still to go. A split pushes the lower half of them as
+        // work items. The children overwrite the moves above them, which are done already.
+        Move* first = stack0;
+        for (--stack; stack >= first; --stack)
         {
-            WorkResult result = { 0, 0 };
-            workQueue[threadIndex]->lock();
-            size_t marker = workQueue[threadIndex]->marker();
-            for (--stack; stack >= stack0; --stack)
+            if (stack > first && shouldSplit(threadIndex, childNodes))
             {
-                const Move& move = *stack;
-                Position tmpPos = make(pos, move);
-                WorkItem perftItem = { tmpPos, depth - 1, &result };
-                workQueue[threadIndex]->push_front_unsafe(perftItem);
+                int items = static_cast<int>(stack - first + 1) / 2;
+                for (int i = 0; i < items; ++i)
+                {
+                    WorkItem perftItem = { &pos, &result, first[i], static_cast<int16_t>(depth - 1), 1 };
+                    workQueue[threadIndex]->push_front(perftItem);
+                }
+                first += items;
+                announceWork(items);
             }
-            workQueue[threadIndex]->unlock();
 
-            WorkItem item;
-            while (workQueue[threadIndex]->try_pop_front(item, marker))
+            Position tmpPos = make(pos, *stack);
+            if (depth - 1 >= MinSplitDepth)
+            {
+                count += perftMultithreaded(tmpPos, depth - 1, stack, threadIndex);
+            }
+            else
             {
-                assert(item.result == &result);
+                count += (tmpPos.state & TurnWhite) ? perft<White>(tmpPos, depth - 1, stack) : perft<Black>(tmpPos, depth - 1, stack);
+            }
+        }
+
+        // All the moves of this node are done, so the rest reuses its part of the stack
+        WorkItem item;
+        while (workQueue[threadIndex]->try_pop_front(item, marker))
+        {
+            assert(item.result == &result);
+
+            bool traced = traceEnabled && traceSample();
+            auto traceStart = traced ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
 
-                item.result->count += perftMultithreaded(item.pos, item.depth, threadLocalStack[threadIndex], threadIndex);
-                item.result->workLeft--;
+            Position itemPos = item.position();
+            uint64_t itemCount = perftMultithreaded(itemPos, item.depth, stack0, threadIndex);
+            if (traced)
+            {
+                traceEvent(TraceKind::Item, traceStart, item.depth, boardKey(itemPos), itemCount);
             }
+#if SCHEDULER_STATS
+            countItem(workerStats[threadIndex], itemCount);
+#endif
+            item.result->count += itemCount;
+            item.result->workLeft--;
+        }
 
-            // There might be someone else still working on this work list
-            bool once = true;
-            while (result.workLeft)
+        // There might be someone else still working on the items. While helping, the wait
+        // nests, and only the outermost one is timed.
+        if (result.workLeft)
+        {
+            bool traced = traceEnabled && traceSample();
+            auto waitStart = std::chrono::steady_clock::now();
+            waitForStolenWork(result, stack0, threadIndex);
+            if (!helpNesting)
             {
-                if (once)
-                {
-                    int workLeft = result.workLeft;
-                    once = false;
-                }
-                std::this_thread::yield();
+                workerStats[threadIndex].waiting.add(toNanoseconds(std::chrono::steady_clock::now() - waitStart));
+            }
+            if (traced)
+            {
+                traceEvent(TraceKind::Wait, waitStart, depth, boardKey(pos), result.count);
             }
+        }
+        count += result.count;
 
-            return result.count;
+#if HASH_TABLE
+        if (depth >= MinHashDepth)
+        {
+#if COLLECT_STATS
+            threadStats().hashDepth(depth).storeTries++;
+#endif
+            if (hashTable->insert(pos, static_cast<uint16_t>(depth), count))
+            {
+#if COLLECT_STATS
+                threadStats().hashDepth(depth).stores++;
+#endif
+            }
         }
-        else
+#endif
+
+        return count;
+    }
+}
+
+static uint64_t perftContinuation(const Position& pos, int depth, Move* stack, int threadIndex);
+
+static uint64_t descend(const Position& pos, int depth, Move* stack, int threadIndex)
+{
+    if (depth >= MinSplitDepth)
+    {
+        return perftContinuation(pos, depth, stack, threadIndex);
+    }
+    return (pos.state & TurnWhite) ? perft<White>(pos, depth, stack) : perft<Black>(pos, depth, stack);
+}
+
+// Claims moves of the frame until they run out. Meanwhile the frame is in the queue of this
+// worker, so that more thieves can join. The stack is above the moves of the frame, which stay
+// intact, because a thief reads its move only after claiming it.
+static uint64_t workOnFrame(Frame& frame, Move* stack, int threadIndex)
+{
+    WorkQueue* queue = workQueue[threadIndex];
+    int64_t marker = queue->marker();
+    if (frame.next.load(std::memory_order_relaxed) > 1)
+    {
+        WorkItem entry = { frame.pos, &frame, Move(), static_cast<int16_t>(frame.depth), 1 };
+        queue->push_front(entry);
+        announceWork(1);
+    }
+
+    uint64_t count = 0;
+    int i;
+    while ((i = frame.next.fetch_sub(1, std::memory_order_relaxed) - 1) >= 0)
+    {
+        Position tmpPos = make(*frame.pos, frame.moves[i]);
+        count += descend(tmpPos, frame.depth - 1, stack, threadIndex);
+    }
+
+    // Nobody took the entry
+    WorkItem entry;
+    if (queue->try_pop_front(entry, marker))
+    {
+        frame.workLeft--;
+    }
+    return count;
+}
+
+static void initFrame(Frame& frame, const Position& pos, int depth, const Move* moves, int numMoves)
+{
+    frame.count = 0;
+    frame.workLeft = 0;
+    frame.thieves = 0;
+    frame.pos = &pos;
+    frame.moves = moves;
+    frame.next = numMoves;
+    frame.depth = depth;
+}
+
+// Continuation stealing: the worker descends into the first move right away, and only publishes
+// the rest of the move list, which the thieves make into positions themselves
+static uint64_t perftContinuation(const Position& pos, int depth, Move* stack, int threadIndex)
+{
+    Move* stack0 = stack;
+
+#if !LEAF_NODE_BULK_COUNT
+    if (depth == 0) return 1;
+#endif
+
+#if HASH_TABLE
+    if (depth >= MinHashDepth)
+    {
+        uint64_t entry = hashTable->find(pos, depth);
+#if COLLECT_STATS
+        threadStats().hashDepth(depth).probes++;
+#endif
+        if (entry != InvalidHashTableEntry)
         {
-            uint64_t count = 0;
+#if COLLECT_STATS
+            threadStats().hashDepth(depth).hits++;
+#endif
+            return entry;
+        }
+    }
+#endif
+
+    stack = generateMoves(pos, stack);
 
-            for (--stack; stack >= stack0; --stack)
+#if LEAF_NODE_BULK_COUNT
+    if (depth == 1)
+    {
+        return static_cast<uint64_t>(stack - stack0);
+    }
+#endif
+
+    uint64_t count = 0;
+    if (numWorkerThreads > 1)
+    {
+        Frame frame;
+        initFrame(frame, pos, depth, stack0, static_cast<int>(stack - stack0));
+        count = workOnFrame(frame, stack, threadIndex);
+
+        if (frame.workLeft)
+        {
+            bool traced = traceEnabled && traceSample();
+            auto waitStart = std::chrono::steady_clock::now();
+            waitForStolenWork(frame, stack, threadIndex);
+            if (!helpNesting)
             {
-                const Move& move = *stack;
-                Position tmpPos = make(pos, move);
-                count += perft(tmpPos, depth - 1, stack);
+                workerStats[threadIndex].waiting.add(toNanoseconds(std::chrono::steady_clock::now() - waitStart));
             }
+            if (traced)
+            {
+                traceEvent(TraceKind::Wait, waitStart, depth, boardKey(pos), frame.count);
+            }
+        }
+        count += frame.count;
+    }
+    else
+    {
+        for (--stack; stack >= stack0; --stack)
+        {
+            Position tmpPos = make(pos, *stack);
+            count += descend(tmpPos, depth - 1, stack, threadIndex);
+        }
+    }
 
-            return count;
+#if HASH_TABLE
+    if (depth >= MinHashDepth)
+    {
+#if COLLECT_STATS
+        threadStats().hashDepth(depth).storeTries++;
+#endif
+        if (hashTable->insert(pos, static_cast<uint16_t>(depth), count))
+        {
+#if COLLECT_STATS
+            threadStats().hashDepth(depth).stores++;
+#endif
         }
     }
+#endif
+
+    return count;
 }
 
-void initMultiPerft()
+void initMultiPerft(int numWorkers, NumaPolicy numaPolicy, const Affinity& affinity, Scheduler engine)
 {
+    scheduler = engine;
     runState = RunState::Initializing;
-    for (int i = 0; i < NumWorkerThreads; i++)
+    workersReady = 0;
+
+    numWorkerThreads = numWorkers > 0 ? numWorkers : static_cast<int>(std::thread::hardware_concurrency());
+    if (numWorkerThreads < 1) numWorkerThreads = 1;
+    workQueue.assign(numWorkerThreads, nullptr);
+    threadLocalStack.assign(numWorkerThreads, nullptr);
+    worker.assign(numWorkerThreads, nullptr);
+    workerStats = std::vector<WorkerStats>(numWorkerThreads);
+#if SCHEDULER_STATS
+    for (WorkerStats& stats : workerStats)
+    {
+        initWorkerStats(stats, numWorkerThreads);
+    }
+#endif
+    parkedWorkers = 0;
+    stealRequests = 0;
+
+    // Consecutive workers share a node, so that the work they steal from each other stays local.
+    // A CPU given by the affinity policy overrides the node.
+    std::vector<int> cpus = threadCpus(numWorkerThreads, affinity);
+    int numNodes = static_cast<int>(numaNodes().size());
+    for (int i = 0; i < numWorkerThreads; i++)
     {
-        threadLocalStack[i] = new Move[MaxMoveStackSize];
-        workQueue[i] = new WorkQueue(MaxWorkQueueSize);
-        worker[i] = new std::thread(worker_loop, i);
+        int node = (numaPolicy != NumaPolicy::None && numNodes > 1) ? i * numNodes / numWorkerThreads : -1;
+        worker[i] = new std::thread(worker_loop, i, cpus[i], node);
+    }
+
+    while (workersReady < numWorkerThreads)
+    {
+        std::this_thread::yield();
     }
 }
 
-uint64_t runMultiPerft(const Position& pos, int depth)
+#if SCHEDULER_STATS
+static void printWorkerReportSoFar()
 {
-    WorkResult result = { 0, 0 };
-    WorkItem item = { pos, depth, &result };
-    workQueue[0]->push_back(item);
+    std::chrono::duration<double> run = std::chrono::steady_clock::now() - runStart;
+    printWorkerStats(workerStats, run.count());
+}
+#endif
 
+static void beginRun()
+{
+    runStart = std::chrono::steady_clock::now();
+#if SCHEDULER_STATS
+    startReportOnRequest(printWorkerReportSoFar);
+#endif
     runState = RunState::Running;
+}
+
+static void endRun()
+{
+#if SCHEDULER_STATS
+    stopReportOnRequest();
+#endif
+    runEnd = std::chrono::steady_clock::now();
+}
 
-    while (result.workLeft)
+uint64_t runMultiPerft(const Position& pos, int depth)
+{
+    if (scheduler == Scheduler::ContinuationStealing)
     {
-        using namespace std::chrono_literals;
-        std::this_thread::sleep_for(5ms);
+        // The main thread owns the root frame, and the workers take it from the first queue
+        Move moves[MaxMovesPerNode];
+        int numMoves = static_cast<int>(generateMoves(pos, moves) - moves);
+        if (depth <= 1)
+        {
+            return depth ? numMoves : 1;
+        }
+
+        Frame frame;
+        initFrame(frame, pos, depth, moves, numMoves);
+        WorkItem entry = { &pos, &frame, Move(), static_cast<int16_t>(depth), 1 };
+        workQueue[0]->push_front(entry); // The workers are not running yet
+
+        beginRun();
+        waitForStolenWork(frame, nullptr, -1);
+        endRun();
+
+        return frame.count;
+    }
+
+    WorkResult result = { 0, 0, 0 };
+    WorkItem item = { &pos, &result, Move(), static_cast<int16_t>(depth), 1 };
+    workQueue[0]->push_front(item); // The workers are not running yet
+
+    beginRun();
+    waitForStolenWork(result, nullptr, -1);
+    endRun();
+
+    return result.count;
+}
+
+// The positions of the root frontier, in blocks that keep their alignment and never move
+class FrontierPositions
+{
+public:
+    FrontierPositions() : m_size(0) {}
+    ~FrontierPositions()
+    {
+        for (Position* block : m_blocks)
+        {
+            _aligned_free(block);
+        }
+    }
+
+    size_t size() const { return m_size; }
+    Position& operator[](size_t index) { return m_blocks[index / BlockSize][index % BlockSize]; }
+
+    void push_back(const Position& pos)
+    {
+        if (m_size == m_blocks.size() * BlockSize)
+        {
+            m_blocks.push_back(static_cast<Position*>(_aligned_malloc(BlockSize * sizeof(Position), alignof(Position))));
+        }
+        (*this)[m_size++] = pos;
+    }
+private:
+    static constexpr size_t BlockSize = 4096;
+
+    std::vector<Position*> m_blocks;
+    size_t m_size;
+};
+
+struct Frontier
+{
+    FrontierPositions positions;
+    std::vector<uint32_t> multiplicity;
+    std::unordered_multimap<uint64_t, size_t> index;
+};
+
+static bool sameBoard(const Position& a, const Position& b)
+{
+    return a.p == b.p && a.n == b.n && a.bq == b.bq && a.rq == b.rq && a.k == b.k && a.w == b.w && a.state == b.state;
+}
+
+// Transpositions are merged into one unit, which counts as many times as it was reached
+static void expandFrontier(const Position& pos, int depth, Move* stack, Frontier& frontier)
+{
+    if (depth == 0)
+    {
+        uint64_t key = boardKey(pos);
+        auto range = frontier.index.equal_range(key);
+        for (auto it = range.first; it != range.second; ++it)
+        {
+            if (sameBoard(frontier.positions[it->second], pos))
+            {
+                frontier.multiplicity[it->second]++;
+                return;
+            }
+        }
+        frontier.index.emplace(key, frontier.positions.size());
+        frontier.positions.push_back(pos);
+        frontier.multiplicity.push_back(1);
+        return;
+    }
+
+    Move* end = generateMoves(pos, stack);
+    for (Move* move = stack; move < end; ++move)
+    {
+        expandFrontier(make(pos, *move), depth - 1, end, frontier);
+    }
+}
+
+// The size of a unit is extrapolated from its first two levels. They are counted by generating
+// the moves only, so the estimates leave nothing in the hash table. Up to depth 2 the count of
+// the unit is exact.
+static double estimateUnit(const Position& pos, int depth, Move* stack, uint64_t& exact)
+{
+    Move* end = generateMoves(pos, stack);
+    uint64_t n1 = end - stack;
+    exact = n1;
+    if (depth == 1 || n1 == 0) return std::max(static_cast<double>(n1), 1.0);
+
+    uint64_t n2 = 0;
+    for (Move* move = stack; move < end; ++move)
+    {
+        n2 += generateMoves(make(pos, *move), end) - end;
+    }
+    exact = n2;
+    return std::max(n2 * std::pow(static_cast<double>(n2) / n1, depth - 2), 1.0);
+}
+
+uint64_t runFrontierPerft(const Position& pos, int depth, int frontierDepth)
+{
+    if (scheduler != Scheduler::ChildStealing)
+    {
+        printf("Root partitioning needs the child stealing scheduler, searching without it\n");
+        return runMultiPerft(pos, depth);
+    }
+    frontierDepth = std::min(frontierDepth, depth - 1);
+    if (frontierDepth < 1)
+    {
+        return runMultiPerft(pos, depth);
+    }
+
+    auto planStart = std::chrono::steady_clock::now();
+
+    std::vector<Move> stack(MaxMoveStackSize);
+    Frontier frontier;
+    expandFrontier(pos, frontierDepth, stack.data(), frontier);
+
+    size_t numUnits = frontier.positions.size();
+    int unitDepth = depth - frontierDepth;
+    std::vector<double> estimate(numUnits);
+    uint64_t exactCount = 0;
+    {
+#if COLLECT_STATS
+        // The captures and checkmates of the estimates are not part of the search
+        ThreadStats scratch{};
+        ThreadStats* stats = threadStatsBlock;
+        threadStatsBlock = &scratch;
+#endif
+        for (size_t i = 0; i < numUnits; i++)
+        {
+            uint64_t exact;
+            estimate[i] = estimateUnit(frontier.positions[i], unitDepth, stack.data(), exact);
+            exactCount += exact * frontier.multiplicity[i];
+        }
+#if COLLECT_STATS
+        threadStatsBlock = stats;
+#endif
+    }
+
+    uint64_t reached = 0;
+    for (uint32_t m : frontier.multiplicity) reached += m;
+
+    // Shallow units were already counted exactly, so there is nothing left to search
+    if (unitDepth <= 2)
+    {
+        std::chrono::duration<double> planning = std::chrono::steady_clock::now() - planStart;
+        printf("Frontier at depth %d: %" PRIu64 " positions, %zu unique, counted in %.3f s\n",
+            frontierDepth, reached, numUnits, planning.count());
+        return exactCount;
     }
 
+    // Longest processing time first: the largest unit goes to the least loaded worker
+    std::vector<size_t> order(numUnits);
+    for (size_t i = 0; i < numUnits; i++) order[i] = i;
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return estimate[a] > estimate[b]; });
+
+    typedef std::pair<double, int> Load;
+    std::priority_queue<Load, std::vector<Load>, std::greater<Load>> loads;
+    for (int i = 0; i < numWorkerThreads; i++) loads.push(Load(0.0, i));
+
+    std::vector<std::vector<size_t>> assigned(numWorkerThreads);
+    double maxLoad = 0.0;
+    double totalLoad = 0.0;
+    for (size_t unit : order)
+    {
+        Load load = loads.top();
+        loads.pop();
+        assigned[load.second].push_back(unit);
+        load.first += estimate[unit];
+        maxLoad = std::max(maxLoad, load.first);
+        totalLoad += estimate[unit];
+        loads.push(load);
+    }
+
+    // The smallest units go in first, to the back of the queues, so the workers start from the
+    // largest, and the thieves only take the small ones at the tail. The workers are not running yet.
+    WorkResult result = { 0, 0, 0 };
+    for (int i = 0; i < numWorkerThreads; i++)
+    {
+        for (auto it = assigned[i].rbegin(); it != assigned[i].rend(); ++it)
+        {
+            WorkItem item = { &frontier.positions[*it], &result, Move(), static_cast<int16_t>(unitDepth), frontier.multiplicity[*it] };
+            workQueue[i]->push_front(item);
+        }
+    }
+
+    std::chrono::duration<double> planning = std::chrono::steady_clock::now() - planStart;
+    printf("Frontier at depth %d: %" PRIu64 " positions, %zu unique, planned in %.3f s, predicted imbalance %.1f %%\n",
+        frontierDepth, reached, numUnits, planning.count(), totalLoad > 0 ? 100.0 * (maxLoad * numWorkerThreads / totalLoad - 1.0) : 0.0);
+
+    beginRun();
+    waitForStolenWork(result, nullptr, -1);
+    endRun();
+
     return result.count;
 }
 
 void releaseMultiPerft()
 {
     runState = RunState::Exiting;
-    for (int i = 0; i < NumWorkerThreads; i++)
+    workSignal++;
+    wakeAllParked(workSignal);
+
+    // All workers must stop before any queue goes, because they steal from each other
+    for (int i = 0; i < numWorkerThreads; i++)
     {
         worker[i]->join();
         delete worker[i];
-
+    }
+    for (int i = 0; i < numWorkerThreads; i++)
+    {
         if (workQueue[i])
         {
             delete workQueue[i];
         }
         if (threadLocalStack[i])
         {
-            delete[] threadLocalStack[i];
+            freeLarge(threadLocalStack[i]);
         }
     }
 }
 
+void printWorkerReport()
+{
+    std::chrono::duration<double> run = runEnd - runStart;
+    printWorkerStats(workerStats, run.count());
+}
+
 #endif
@@ -13,6 +13,11 @@
 #if HASH_TABLE
 #include "HashTable.hpp"
 #endif
+#if MULTITHREADED
+#include "Topology.hpp"
+
+#include <atomic>
+#endif
 
 template<Color C>
 uint64_t perft(const Position& pos, int depth, Move* stack)
@@ -28,15 +33,15 @@ uint64_t perft(const Position& pos, int depth, Move* stack)
     {
         uint64_t entry = hashTable->find(pos, depth);
 #if COLLECT_STATS
-        statsHashProbes++;
+        threadStats().hashDepth(depth).probes++;
 #endif
         if (entry != InvalidHashTableEntry)
         {
 #if COLLECT_STATS
-            statsHashHits++;
+            threadStats().hashDepth(depth).hits++;
 #endif
             return entry;
-}
+        }
     }
 #endif
 
@@ -58,7 +63,7 @@ uint64_t perft(const Position& pos, int depth, Move* stack)
             if (stack == stack0)
             {
 #if COLLECT_STATS
-                statsCheckmates++;
+                threadStats().checkmates++;
 #endif
             }
         }
@@ -77,12 +82,12 @@ uint64_t perft(const Position& pos, int depth, Move* stack)
         if (1 >= MinHashDepth)
         {
 #if COLLECT_STATS
-            statsHashWriteTries++;
+            threadStats().hashDepth(depth).storeTries++;
 #endif
-            if (hashTable->insert({ pos, static_cast<uint16_t>(depth), count }))
+            if (hashTable->insert(pos, static_cast<uint16_t>(depth), count))
             {
 #if COLLECT_STATS
-                statsHashWrites++;
+                threadStats().hashDepth(depth).stores++;
 #endif
             }
         }
@@ -98,7 +103,7 @@ uint64_t perft(const Position& pos, int depth, Move* stack)
             if (stack == stack0)
             {
 #if COLLECT_STATS
-                statsCheckmates++;
+                threadStats().checkmates++;
 #endif
             }
         }
@@ -115,9 +120,27 @@ uint64_t perft(const Position& pos, int depth, Move* stack)
 
         uint64_t count = 0;
 
+#if HASH_TABLE && !HASH_SYMMETRY // The symmetric keys are not known before make()
+        // Overlap the memory latency of the children's hash probes with the work on their siblings
+        bool prefetch = depth - 1 >= MinHashDepth;
+        if (prefetch)
+        {
+            for (int i = 1; i <= HashPrefetchDistance && stack - i >= stack0; ++i)
+            {
+                hashTable->prefetch(HashTable::childKey(pos, *(stack - i)), depth - 1);
+            }
+        }
+#endif
+
         for (--stack; stack >= stack0; --stack)
         {
             const Move& move = *stack;
+#if HASH_TABLE && !HASH_SYMMETRY
+            if (prefetch && stack - HashPrefetchDistance >= stack0)
+            {
+                hashTable->prefetch(HashTable::childKey(pos, *(stack - HashPrefetchDistance)), depth - 1);
+            }
+#endif
             Position tmpPos = make(pos, move);
             count += perft<1 - C>(tmpPos, depth - 1, stack);
         }
@@ -126,12 +149,12 @@ uint64_t perft(const Position& pos, int depth, Move* stack)
         if (depth >= MinHashDepth)
         {
 #if COLLECT_STATS
-            statsHashWriteTries++;
+            threadStats().hashDepth(depth).storeTries++;
 #endif
-            if (hashTable->insert({ pos, static_cast<uint16_t>(depth), count }))
+            if (hashTable->insert(pos, static_cast<uint16_t>(depth), count))
             {
 #if COLLECT_STATS
-                statsHashWrites++;
+                threadStats().hashDepth(depth).stores++;
 #endif
             }
         }
@@ -149,11 +172,26 @@ enum class RunState
     Exiting
 };
 
-extern RunState runState;
+enum class Scheduler
+{
+    ChildStealing,          // A split pushes its children as work items, and the worker takes them one by one
+    ContinuationStealing    // A node publishes the rest of its move list, and the worker descends into the first move
+};
+
+extern std::atomic<RunState> runState;
 
-void initMultiPerft();
+// Zero workers means one for each hardware thread
+void initMultiPerft(int numWorkers, NumaPolicy numaPolicy, const Affinity& affinity, Scheduler engine);
 uint64_t runMultiPerft(const Position& pos, int depth);
+
+// Expands the root to the frontier depth first, merges the transpositions, and deals the
+// positions to the workers, largest first. Needs the child stealing scheduler.
+uint64_t runFrontierPerft(const Position& pos, int depth, int frontierDepth);
 void releaseMultiPerft();
 
+// Idle time of each worker in the last run, and with SCHEDULER_STATS the scheduler telemetry.
+// Call after releaseMultiPerft().
+void printWorkerReport();
+
 uint64_t perftMultithreaded(const Position& pos, int depth, Move* stack, int threadIndex);
 #endif
@@ -0,0 +1,141 @@
+// Copyright 2022 Samuel Siltanen
+// SchedulerStats.cpp
+
+#include "SchedulerStats.hpp"
+
+#include <cinttypes>
+#include <csignal>
+#include <cstdio>
+
+#if SCHEDULER_STATS
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <intrin.h>
+
+void initWorkerStats(WorkerStats& stats, int numWorkers)
+{
+    stats.victims = std::vector<StatsCounter>(2 * numWorkers + 2 * VictimPadding);
+}
+
+void countItem(WorkerStats& stats, uint64_t nodes)
+{
+    unsigned long bucket = 0;
+    if (nodes) _BitScanReverse64(&bucket, nodes);
+    stats.items++;
+    stats.itemSizes[bucket < ItemSizeBuckets ? bucket : ItemSizeBuckets - 1]++;
+}
+
+void countSteal(WorkerStats& stats, int victim, bool stolen, bool lost)
+{
+    stats.victims[VictimPadding + 2 * victim + (stolen ? 0 : 1)]++;
+    if (lost) stats.lostSteals++;
+}
+
+#ifdef _WIN32
+constexpr int ReportSignal = SIGBREAK;
+#else
+constexpr int ReportSignal = SIGUSR1;
+#endif
+
+// The handler only raises the flag, and a thread of its own polls it and prints
+static volatile std::sig_atomic_t reportRequested = 0;
+static std::thread* reporter = nullptr;
+static std::mutex reporterMutex;
+static std::condition_variable reporterWake;
+static bool reporterStop = false;
+
+static void requestReport(int)
+{
+    reportRequested = 1;
+    signal(ReportSignal, requestReport);
+}
+
+void startReportOnRequest(void (*report)())
+{
+    reporterStop = false;
+    reportRequested = 0;
+    signal(ReportSignal, requestReport);
+    reporter = new std::thread([report]
+    {
+        std::unique_lock<std::mutex> lock(reporterMutex);
+        while (!reporterWake.wait_for(lock, std::chrono::milliseconds(100), [] { return reporterStop; }))
+        {
+            if (reportRequested)
+            {
+                reportRequested = 0;
+                report();
+                fflush(stdout);
+            }
+        }
+    });
+}
+
+void stopReportOnRequest()
+{
+    if (!reporter) return;
+    {
+        std::lock_guard<std::mutex> lock(reporterMutex);
+        reporterStop = true;
+    }
+    reporterWake.notify_one();
+    reporter->join();
+    delete reporter;
+    reporter = nullptr;
+    signal(ReportSignal, SIG_DFL);
+}
+#endif
+
+static double seconds(const StatsCounter& nanoseconds)
+{
+    return static_cast<double>(nanoseconds.load()) * 1e-9;
+}
+
+void printWorkerStats(const std::vector<WorkerStats>& stats, double runSeconds)
+{
+    int numWorkers = static_cast<int>(stats.size());
+    for (int i = 0; i < numWorkers; i++)
+    {
+        const WorkerStats& worker = stats[i];
+        double idle = seconds(worker.idle);
+        printf("Worker %d idle %.3f s (%.1f %%), waiting for stolen work %.3f s of which helping the thieves %.3f s (%" PRIu64 " items), parked %" PRIu64 " times\n",
+            i, idle, runSeconds > 0 ? 100.0 * idle / runSeconds : 0.0, seconds(worker.waiting), seconds(worker.helping), worker.helps.load(), worker.parks.load());
+#if SCHEDULER_STATS
+        uint64_t steals = 0;
+        uint64_t failedSteals = 0;
+        for (int v = 0; v < numWorkers; v++)
+        {
+            steals += worker.victims[VictimPadding + 2 * v].load();
+            failedSteals += worker.victims[VictimPadding + 2 * v + 1].load();
+        }
+        printf("    %" PRIu64 " items, %" PRIu64 " steals, %" PRIu64 " failed of which %" PRIu64 " lost a race, yielding %.3f s, parked %.3f s\n",
+            worker.items.load(), steals, failedSteals, worker.lostSteals.load(), seconds(worker.yielding), seconds(worker.parked));
+        printf("    Steals / failed by victim:");
+        for (int v = 0; v < numWorkers; v++)
+        {
+            printf(" %d:%" PRIu64 "/%" PRIu64, v, worker.victims[VictimPadding + 2 * v].load(), worker.victims[VictimPadding + 2 * v + 1].load());
+        }
+        printf("\n");
+#endif
+    }
+
+#if SCHEDULER_STATS
+    printf("Work item sizes:\n");
+    for (int b = 0; b < ItemSizeBuckets; b++)
+    {
+        uint64_t items = 0;
+        for (const WorkerStats& worker : stats)
+        {
+            items += worker.itemSizes[b].load();
+        }
+        if (items)
+        {
+            // unsigned long long is not uint64_t everywhere, so PRIu64 needs the exact type
+            uint64_t low = b ? static_cast<uint64_t>(1) << b : 0;
+            uint64_t high = (static_cast<uint64_t>(2) << b) - 1;
+            printf("    %" PRIu64 " - %" PRIu64 " nodes: %" PRIu64 "\n", low, high, items);
+        }
+    }
+#endif
+}
@@ -0,0 +1,50 @@
+// Copyright 2022 Samuel Siltanen
+// SchedulerStats.hpp
+
+#pragma once
+
+#include "Config.hpp"
+#include "Stats.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+constexpr int ItemSizeBuckets = 48; // Work items by the log2 of their node count
+constexpr int VictimPadding = 8;    // Counters on both sides of the victim counters, against false sharing
+
+// Counters of one worker, on cache lines of their own. The idle times are always kept, the rest
+// only with SCHEDULER_STATS. The times are in nanoseconds.
+struct alignas(64) WorkerStats
+{
+    StatsCounter idle;          // Looking for work
+    StatsCounter waiting;       // Waiting for the stolen items of its own splits
+    StatsCounter helping;       // Part of the waiting spent on the thieves' work
+    StatsCounter parks;
+    StatsCounter helps;
+#if SCHEDULER_STATS
+    StatsCounter items;
+    StatsCounter lostSteals;    // There was an item, but another thief or the owner got it first
+    StatsCounter yielding;
+    StatsCounter parked;
+    StatsCounter itemSizes[ItemSizeBuckets];
+    std::vector<StatsCounter> victims; // Steals and failed steals, two for each victim
+#endif
+};
+
+__forceinline uint64_t toNanoseconds(std::chrono::steady_clock::duration duration)
+{
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+}
+
+#if SCHEDULER_STATS
+void initWorkerStats(WorkerStats& stats, int numWorkers);
+void countItem(WorkerStats& stats, uint64_t nodes);
+void countSteal(WorkerStats& stats, int victim, bool stolen, bool lost);
+
+// Print the report also when asked for while the search runs: SIGUSR1, or Ctrl+Break on Windows
+void startReportOnRequest(void (*report)());
+void stopReportOnRequest();
+#endif
+
+void printWorkerStats(const std::vector<WorkerStats>& stats, double runSeconds);
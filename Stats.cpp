@@ -5,60 +5,363 @@
 
 #if COLLECT_STATS
 
+#include <chrono>
+#include <condition_variable>
 #include <cstdio>
 #include <cinttypes>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #if HASH_TABLE
 #include "HashTable.hpp"
 #endif
 
-std::atomic<int> statsCaptures = 0;
-std::atomic<int> statsEPs = 0;
-std::atomic<int> statsCastles = 0;
-std::atomic<int> statsCheckmates = 0;
-std::atomic<int> statsHashProbes = 0;
-std::atomic<int> statsHashHits = 0;
-std::atomic<int> statsHashWriteTries = 0;
-std::atomic<int> statsHashWrites = 0;
+thread_local ThreadStats* threadStatsBlock = nullptr;
+
+// The blocks are kept after their threads exit, so that their counts stay in the totals
+static std::mutex statsMutex;
+static std::vector<ThreadStats*> statsBlocks;
+
+struct StatsTotals
+{
+    uint64_t captures;
+    uint64_t eps;
+    uint64_t castles;
+    uint64_t checkmates;
+    uint64_t hashVerifyMismatches;
+    uint64_t probes[MaxStatsDepth];
+    uint64_t hits[MaxStatsDepth];
+    uint64_t storeTries[MaxStatsDepth];
+    uint64_t stores[MaxStatsDepth];
+    uint64_t replacements[MaxStatsDepth];
+    uint64_t evictedCount[MaxStatsDepth];
+};
+
+ThreadStats* registerThreadStats()
+{
+    ThreadStats* stats = new ThreadStats();
+    {
+        std::lock_guard<std::mutex> lock(statsMutex);
+        statsBlocks.push_back(stats);
+    }
+    threadStatsBlock = stats;
+    return stats;
+}
+
+static void resetCounter(StatsCounter& counter)
+{
+    counter.value.store(0, std::memory_order_relaxed);
+}
+
+static StatsTotals sumStats()
+{
+    StatsTotals totals = {};
+
+    std::lock_guard<std::mutex> lock(statsMutex);
+    for (const ThreadStats* stats : statsBlocks)
+    {
+        totals.captures += stats->captures.load();
+        totals.eps += stats->eps.load();
+        totals.castles += stats->castles.load();
+        totals.checkmates += stats->checkmates.load();
+        totals.hashVerifyMismatches += stats->hashVerifyMismatches.load();
+        for (int d = 0; d < MaxStatsDepth; ++d)
+        {
+            const HashDepthStats& depth = stats->hashDepths[d];
+            totals.probes[d] += depth.probes.load();
+            totals.hits[d] += depth.hits.load();
+            totals.storeTries[d] += depth.storeTries.load();
+            totals.stores[d] += depth.stores.load();
+            totals.replacements[d] += depth.replacements.load();
+            totals.evictedCount[d] += depth.evictedCount.load();
+        }
+    }
+    return totals;
+}
+
+static uint64_t sumDepths(const uint64_t* counts)
+{
+    uint64_t sum = 0;
+    for (int d = 0; d < MaxStatsDepth; ++d)
+    {
+        sum += counts[d];
+    }
+    return sum;
+}
+
+#if HASH_TABLE
+constexpr uint64_t SnapshotLines = 4096;        // Lines sampled for an occupancy snapshot
+constexpr uint64_t HistogramLines = 1 << 20;    // Lines sampled for the line fill at the end
+constexpr size_t MaxSnapshots = 256;            // Then every other one is dropped and the interval doubles
+constexpr std::chrono::milliseconds FirstSnapshotInterval(100);
+
+struct OccupancySnapshot
+{
+    double seconds;
+    uint64_t probes;
+    uint64_t hits;
+    uint64_t stores;
+    uint64_t replacements;
+    double occupancy[NumHashTables];    // Share of the entries in use
+};
+
+static std::thread* sampler = nullptr;
+static std::mutex samplerMutex;
+static std::condition_variable samplerWake;
+static bool samplerStop = false;
+static std::chrono::steady_clock::time_point samplingStart;
+static std::vector<OccupancySnapshot> snapshots;
+
+static void takeSnapshot()
+{
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - samplingStart;
+    StatsTotals totals = sumStats();
+
+    OccupancySnapshot snapshot = {};
+    snapshot.seconds = elapsed.count();
+    snapshot.probes = sumDepths(totals.probes);
+    snapshot.hits = sumDepths(totals.hits);
+    snapshot.stores = sumDepths(totals.stores);
+    snapshot.replacements = sumDepths(totals.replacements);
+
+    OccupancySample samples[NumHashTables];
+    int numTables = hashTable->sampleOccupancy(SnapshotLines, samples);
+    for (int t = 0; t < numTables; ++t)
+    {
+        uint64_t used = 0;
+        for (uint32_t i = 1; i <= samples[t].lineEntries; ++i)
+        {
+            used += samples[t].lineFill[i] * i;
+        }
+        snapshot.occupancy[t] = static_cast<double>(used) / (samples[t].lines * samples[t].lineEntries);
+    }
+    snapshots.push_back(snapshot);
+}
+
+static void samplerLoop()
+{
+    std::chrono::milliseconds interval = FirstSnapshotInterval;
+    std::unique_lock<std::mutex> lock(samplerMutex);
+    while (!samplerWake.wait_for(lock, interval, [] { return samplerStop; }))
+    {
+        takeSnapshot();
+        if (snapshots.size() >= MaxSnapshots)
+        {
+            for (size_t i = 0; i < snapshots.size() / 2; ++i)
+            {
+                snapshots[i] = snapshots[2 * i + 1];
+            }
+            snapshots.resize(snapshots.size() / 2);
+            interval *= 2;
+        }
+    }
+}
+#endif
+
+void startStatsSampling()
+{
+#if HASH_TABLE
+    snapshots.clear();
+    samplerStop = false;
+    samplingStart = std::chrono::steady_clock::now();
+    sampler = new std::thread(samplerLoop);
+#endif
+}
+
+// The last snapshot is taken at the end, so that even a short run has one
+void stopStatsSampling()
+{
+#if HASH_TABLE
+    if (!sampler) return;
+    {
+        std::lock_guard<std::mutex> lock(samplerMutex);
+        samplerStop = true;
+    }
+    samplerWake.notify_one();
+    sampler->join();
+    delete sampler;
+    sampler = nullptr;
+    takeSnapshot();
+#endif
+}
 
 void resetStats()
 {
-    statsCaptures = 0;
-    statsEPs = 0;
-    statsCastles = 0;
-    statsCheckmates = 0;
-    statsHashProbes = 0;
-    statsHashHits = 0;
-    statsHashWriteTries = 0;
-    statsHashWrites = 0;
+    std::lock_guard<std::mutex> lock(statsMutex);
+    for (ThreadStats* stats : statsBlocks)
+    {
+        resetCounter(stats->captures);
+        resetCounter(stats->eps);
+        resetCounter(stats->castles);
+        resetCounter(stats->checkmates);
+        resetCounter(stats->hashVerifyMismatches);
+        for (HashDepthStats& depth : stats->hashDepths)
+        {
+            resetCounter(depth.probes);
+            resetCounter(depth.hits);
+            resetCounter(depth.storeTries);
+            resetCounter(depth.stores);
+            resetCounter(depth.replacements);
+            resetCounter(depth.evictedCount);
+        }
+    }
 }
 
 void printStats(uint64_t count)
 {
-    int sCaps = statsCaptures;
-    int sEPs = statsEPs;
-    int sCsls = statsCastles;
-    int sChks = statsCheckmates;
-    int sHPrs = statsHashProbes;
-    int sHHts = statsHashHits;
-    int sHWts = statsHashWriteTries;
-    int sHWrs = statsHashWrites;
-    printf("Node count = %" PRIu64 " Captures = %d EPs = %d Castles = %d Checkmates = %d"
+    StatsTotals totals = sumStats();
+    uint64_t probes = sumDepths(totals.probes);
+    uint64_t hits = sumDepths(totals.hits);
+    uint64_t storeTries = sumDepths(totals.storeTries);
+    uint64_t stores = sumDepths(totals.stores);
+
+    printf("Node count = %" PRIu64 " Captures = %" PRIu64 " EPs = %" PRIu64 " Castles = %" PRIu64 " Checkmates = %" PRIu64
 #if HASH_TABLE
-        " Hash probes = %d Hash hits = %d Hash write tries = %d Hash writes = %d"
+        " Hash probes = %" PRIu64 " Hash hits = %" PRIu64 " Hash write tries = %" PRIu64 " Hash writes = %" PRIu64
 #endif
         "\n",
-        count, sCaps, sEPs, sCsls, sChks
+        count, totals.captures, totals.eps, totals.castles, totals.checkmates
 #if HASH_TABLE
-        , sHPrs, sHHts, sHWts, sHWrs
+        , probes, hits, storeTries, stores
 #endif
     );
 #if HASH_TABLE
-    float hashTableHitRate = (float)statsHashHits / (float)statsHashProbes;
-    float hashCollisionRate = (float)(statsHashWriteTries - statsHashWrites) / (float)(statsHashWriteTries);
-    printf("Hash table size %dk elements, read hit rate %f %%, write collision rate %f %%\n",
-        1 << (HashTableSize - 10), hashTableHitRate * 100.0f, hashCollisionRate * 100.0f);
+    if (!hashTable->size())
+    {
+        printf("Hash table disabled\n");
+    }
+    else
+    {
+        float hashTableHitRate = (float)hits / (float)probes;
+        float hashCollisionRate = (float)(storeTries - stores) / (float)(storeTries);
+        printf("Hash table size %" PRIu64 "k elements, %s replacement, read hit rate %f %%, write collision rate %f %%\n",
+            hashTable->size() >> 10, HashTable::replacementPolicyName(hashTable->replacementPolicy()),
+            hashTableHitRate * 100.0f, hashCollisionRate * 100.0f);
+#if HASH_DEPTH_BANDS
+        hashTable->printBandStats();
+#endif
+    }
+#if HASH_VERIFY
+    printf("Key mismatches caught by the second key %" PRIu64 "\n", totals.hashVerifyMismatches);
+#endif
+    for (int d = 0; d < MaxStatsDepth; ++d)
+    {
+        if (!totals.probes[d] && !totals.storeTries[d]) continue;
+        printf("Depth %2d probes %" PRIu64 " hits %" PRIu64 " (%.2f %%) writes %" PRIu64 "/%" PRIu64 " replacements %" PRIu64 " evicting %.1f on average\n",
+            d, totals.probes[d], totals.hits[d], totals.probes[d] ? 100.0 * totals.hits[d] / totals.probes[d] : 0.0,
+            totals.stores[d], totals.storeTries[d], totals.replacements[d],
+            totals.replacements[d] ? static_cast<double>(totals.evictedCount[d]) / totals.replacements[d] : 0.0);
+    }
+#endif
+}
+
+bool writeStatsJson(const char* path, uint64_t count, double seconds)
+{
+    FILE* f = nullptr;
+    errno_t err = fopen_s(&f, path, "w");
+    if (err)
+    {
+        printf("Opening %s for the stats failed with error code %d\n", path, err);
+        return false;
+    }
+
+    StatsTotals totals = sumStats();
+
+    fprintf(f, "{\n");
+    fprintf(f, "  \"nodes\": %" PRIu64 ",\n", count);
+    fprintf(f, "  \"seconds\": %.3f,\n", seconds);
+    fprintf(f, "  \"captures\": %" PRIu64 ",\n", totals.captures);
+    fprintf(f, "  \"eps\": %" PRIu64 ",\n", totals.eps);
+    fprintf(f, "  \"castles\": %" PRIu64 ",\n", totals.castles);
+    fprintf(f, "  \"checkmates\": %" PRIu64 ",\n", totals.checkmates);
+
+    fprintf(f, "  \"threads\": [");
+    {
+        std::lock_guard<std::mutex> lock(statsMutex);
+        for (size_t i = 0; i < statsBlocks.size(); ++i)
+        {
+            uint64_t probes = 0, hits = 0, stores = 0;
+            for (const HashDepthStats& depth : statsBlocks[i]->hashDepths)
+            {
+                probes += depth.probes.load();
+                hits += depth.hits.load();
+                stores += depth.stores.load();
+            }
+            fprintf(f, "%s\n    { \"probes\": %" PRIu64 ", \"hits\": %" PRIu64 ", \"stores\": %" PRIu64 " }",
+                i ? "," : "", probes, hits, stores);
+        }
+    }
+    fprintf(f, "\n  ]");
+
+#if HASH_TABLE
+    fprintf(f, ",\n  \"hash\": {\n");
+    fprintf(f, "    \"entries\": %" PRIu64 ",\n", hashTable->size());
+    fprintf(f, "    \"policy\": \"%s\",\n", HashTable::replacementPolicyName(hashTable->replacementPolicy()));
+#if HASH_VERIFY
+    fprintf(f, "    \"verifyMismatches\": %" PRIu64 ",\n", totals.hashVerifyMismatches);
 #endif
+
+    fprintf(f, "    \"depths\": [");
+    bool first = true;
+    for (int d = 0; d < MaxStatsDepth; ++d)
+    {
+        if (!totals.probes[d] && !totals.storeTries[d]) continue;
+        fprintf(f, "%s\n      { \"depth\": %d, \"probes\": %" PRIu64 ", \"hits\": %" PRIu64 ", \"storeTries\": %" PRIu64
+            ", \"stores\": %" PRIu64 ", \"replacements\": %" PRIu64 ", \"averageEvictedCount\": %.1f }",
+            first ? "" : ",", d, totals.probes[d], totals.hits[d], totals.storeTries[d], totals.stores[d], totals.replacements[d],
+            totals.replacements[d] ? static_cast<double>(totals.evictedCount[d]) / totals.replacements[d] : 0.0);
+        first = false;
+    }
+    fprintf(f, "\n    ],\n");
+
+    OccupancySample samples[NumHashTables];
+    int numTables = hashTable->sampleOccupancy(HistogramLines, samples);
+    fprintf(f, "    \"tables\": [");
+    for (int t = 0; t < numTables; ++t)
+    {
+        const OccupancySample& sample = samples[t];
+        fprintf(f, "%s\n      { \"firstDepth\": %d, \"lineEntries\": %u, \"linesSampled\": %" PRIu64 ", \"lineFill\": [",
+            t ? "," : "", sample.firstDepth, sample.lineEntries, sample.lines);
+        for (uint32_t i = 0; i <= sample.lineEntries; ++i)
+        {
+            fprintf(f, "%s%" PRIu64, i ? ", " : "", sample.lineFill[i]);
+        }
+        fprintf(f, "], \"depthEntries\": {");
+        first = true;
+        for (int d = 0; d < MaxStatsDepth; ++d)
+        {
+            if (!sample.depthEntries[d]) continue;
+            fprintf(f, "%s\"%d\": %" PRIu64, first ? " " : ", ", d, sample.depthEntries[d]);
+            first = false;
+        }
+        fprintf(f, " } }");
+    }
+    fprintf(f, "\n    ],\n");
+
+    fprintf(f, "    \"snapshots\": [");
+    for (size_t i = 0; i < snapshots.size(); ++i)
+    {
+        const OccupancySnapshot& snapshot = snapshots[i];
+        fprintf(f, "%s\n      { \"seconds\": %.3f, \"probes\": %" PRIu64 ", \"hits\": %" PRIu64 ", \"stores\": %" PRIu64
+            ", \"replacements\": %" PRIu64 ", \"occupancy\": [",
+            i ? "," : "", snapshot.seconds, snapshot.probes, snapshot.hits, snapshot.stores, snapshot.replacements);
+        for (int t = 0; t < numTables; ++t)
+        {
+            fprintf(f, "%s%.4f", t ? ", " : "", snapshot.occupancy[t]);
+        }
+        fprintf(f, "] }");
+    }
+    fprintf(f, "\n    ]\n  }");
+#endif
+    fprintf(f, "\n}\n");
+
+    bool success = fclose(f) == 0;
+    if (!success)
+    {
+        printf("Writing the stats to %s failed\n", path);
+    }
+    return success;
 }
 
 #endif
@@ -5,20 +5,82 @@
 
 #include "Config.hpp"
 
+#include <atomic>
+#include <cstdint>
+
+// A counter written only by its own thread. Others may read it while it runs, so it is atomic,
+// but an increment is a plain load and store instead of a locked add.
+struct StatsCounter
+{
+    std::atomic<uint64_t> value;
+
+    __forceinline void add(uint64_t n) { value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+    __forceinline void operator++(int) { add(1); }
+    __forceinline uint64_t load() const { return value.load(std::memory_order_relaxed); }
+};
+
 #if COLLECT_STATS
 
-#include <atomic>
+constexpr int MaxStatsDepth = 32;   // Deeper ones are counted in the last depth
+constexpr int MaxLineEntries = 8;   // Most entries on a hash table line of any format
+
+struct HashDepthStats
+{
+    StatsCounter probes;
+    StatsCounter hits;
+    StatsCounter storeTries;
+    StatsCounter stores;
+    StatsCounter replacements;  // Stores that evicted another entry
+    StatsCounter evictedCount;  // Sum of the counts of the evicted entries
+
+    __forceinline void evict(uint64_t count)
+    {
+        replacements++;
+        evictedCount.add(count);
+    }
+};
 
-extern std::atomic<int> statsCaptures;
-extern std::atomic<int> statsEPs;
-extern std::atomic<int> statsCastles;
-extern std::atomic<int> statsCheckmates;
-extern std::atomic<int> statsHashProbes;
-extern std::atomic<int> statsHashHits;
-extern std::atomic<int> statsHashWriteTries;
-extern std::atomic<int> statsHashWrites;
+// Counters of one thread. Each thread has its own block on cache lines of their own, so that
+// counting is cheap enough to leave on and the threads don't false share.
+struct alignas(64) ThreadStats
+{
+    StatsCounter captures;
+    StatsCounter eps;
+    StatsCounter castles;
+    StatsCounter checkmates;
+    StatsCounter hashVerifyMismatches;
+    HashDepthStats hashDepths[MaxStatsDepth];
+
+    __forceinline HashDepthStats& hashDepth(int depth) { return hashDepths[depth < MaxStatsDepth ? depth : MaxStatsDepth - 1]; }
+};
+
+// Entries in use on a sample of the lines of one hash table
+struct OccupancySample
+{
+    int firstDepth;                         // Shallowest depth stored in the table
+    uint32_t lineEntries;                   // Entries on a line
+    uint64_t lines;                         // Lines looked at
+    uint64_t lineFill[MaxLineEntries + 1];  // Lines by the number of entries in use
+    uint64_t depthEntries[MaxStatsDepth];   // Entries in use by depth
+};
+
+extern thread_local ThreadStats* threadStatsBlock;
+ThreadStats* registerThreadStats();
+
+__forceinline ThreadStats& threadStats()
+{
+    ThreadStats* stats = threadStatsBlock;
+    if (!stats) stats = registerThreadStats();
+    return *stats;
+}
 
 void resetStats();
 void printStats(uint64_t count);
 
+// Take occupancy snapshots of the hash table on a thread of its own while perft runs
+void startStatsSampling();
+void stopStatsSampling();
+
+bool writeStatsJson(const char* path, uint64_t count, double seconds);
+
 #endif
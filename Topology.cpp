@@ -0,0 +1,363 @@
+// Copyright 2022 Samuel Siltanen
+// Topology.cpp
+
+#include "Topology.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+// From numaif.h, to avoid depending on libnuma
+constexpr int MPOL_BIND = 2;
+constexpr int MPOL_INTERLEAVE = 3;
+#endif
+
+// Parse a kernel CPU list such as "0-3,8-11"
+static std::vector<int> parseCpuList(const char* list)
+{
+    std::vector<int> cpus;
+    const char* c = list;
+    while (*c >= '0' && *c <= '9')
+    {
+        char* end;
+        int first = static_cast<int>(strtol(c, &end, 10));
+        int last = first;
+        if (*end == '-')
+        {
+            last = static_cast<int>(strtol(end + 1, &end, 10));
+        }
+        for (int cpu = first; cpu <= last; ++cpu)
+        {
+            cpus.push_back(cpu);
+        }
+        c = (*end == ',') ? end + 1 : end;
+    }
+    return cpus;
+}
+
+static std::vector<NumaNode> detectNodes()
+{
+    std::vector<NumaNode> nodes;
+
+#ifdef _WIN32
+    ULONG highestNode = 0;
+    if (GetNumaHighestNodeNumber(&highestNode))
+    {
+        for (USHORT id = 0; id <= highestNode; ++id)
+        {
+            GROUP_AFFINITY affinity;
+            if (!GetNumaNodeProcessorMaskEx(id, &affinity) || !affinity.Mask) continue;
+
+            NumaNode node = { id, {} };
+            for (int bit = 0; bit < 64; ++bit)
+            {
+                if (affinity.Mask & (1ULL << bit)) node.cpus.push_back(affinity.Group * 64 + bit);
+            }
+            nodes.push_back(node);
+        }
+    }
+#else
+    DIR* dir = opendir("/sys/devices/system/node");
+    if (dir)
+    {
+        while (dirent* entry = readdir(dir))
+        {
+            int id;
+            if (sscanf(entry->d_name, "node%d", &id) != 1) continue;
+
+            char path[128];
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", id);
+            FILE* f = fopen(path, "r");
+            if (!f) continue;
+
+            char list[4096] = {};
+            if (fgets(list, sizeof(list), f))
+            {
+                NumaNode node = { id, parseCpuList(list) };
+                if (!node.cpus.empty()) nodes.push_back(node);
+            }
+            fclose(f);
+        }
+        closedir(dir);
+    }
+#endif
+
+    if (nodes.empty())
+    {
+        NumaNode node = { 0, {} };
+        unsigned int numCpus = std::thread::hardware_concurrency();
+        for (unsigned int cpu = 0; cpu < (numCpus ? numCpus : 1); ++cpu)
+        {
+            node.cpus.push_back(static_cast<int>(cpu));
+        }
+        nodes.push_back(node);
+    }
+
+    // Directory order is arbitrary
+    std::sort(nodes.begin(), nodes.end(), [](const NumaNode& a, const NumaNode& b) { return a.id < b.id; });
+
+    return nodes;
+}
+
+const std::vector<NumaNode>& numaNodes()
+{
+    static std::vector<NumaNode> nodes = detectNodes();
+    return nodes;
+}
+
+#ifndef _WIN32
+static int readNumber(const char* path, int fallback)
+{
+    FILE* f = fopen(path, "r");
+    if (!f) return fallback;
+    int number = fallback;
+    if (fscanf(f, "%d", &number) != 1) number = fallback;
+    fclose(f);
+    return number;
+}
+#endif
+
+static std::vector<Cpu> detectCpus()
+{
+    // Without topology information every CPU is a core of its own
+    std::vector<Cpu> result;
+    const std::vector<NumaNode>& nodes = numaNodes();
+    for (int n = 0; n < static_cast<int>(nodes.size()); ++n)
+    {
+        for (int id : nodes[n].cpus)
+        {
+            result.push_back({ id, id, n });
+        }
+    }
+
+#ifdef _WIN32
+    DWORD length = 0;
+    GetLogicalProcessorInformationEx(RelationProcessorCore, nullptr, &length);
+    std::vector<char> buffer(length);
+    if (length && GetLogicalProcessorInformationEx(RelationProcessorCore,
+        reinterpret_cast<SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*>(buffer.data()), &length))
+    {
+        int core = 0;
+        for (DWORD offset = 0; offset < length; ++core)
+        {
+            const SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX* info =
+                reinterpret_cast<const SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*>(buffer.data() + offset);
+            for (WORD g = 0; g < info->Processor.GroupCount; ++g)
+            {
+                const GROUP_AFFINITY& affinity = info->Processor.GroupMask[g];
+                for (Cpu& cpu : result)
+                {
+                    if (cpu.id / 64 == affinity.Group && (affinity.Mask & (1ULL << (cpu.id % 64)))) cpu.core = core;
+                }
+            }
+            offset += info->Size;
+        }
+    }
+#else
+    for (Cpu& cpu : result)
+    {
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/core_id", cpu.id);
+        int coreId = readNumber(path, -1);
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu.id);
+        int packageId = readNumber(path, 0);
+        if (coreId >= 0) cpu.core = (packageId << 16) | coreId;
+    }
+#endif
+
+    std::sort(result.begin(), result.end(), [](const Cpu& a, const Cpu& b)
+    {
+        if (a.node != b.node) return a.node < b.node;
+        if (a.core != b.core) return a.core < b.core;
+        return a.id < b.id;
+    });
+
+    return result;
+}
+
+const std::vector<Cpu>& cpus()
+{
+    static std::vector<Cpu> result = detectCpus();
+    return result;
+}
+
+bool parseAffinity(const char* str, Affinity& affinity)
+{
+    affinity.cpus.clear();
+    if (!strcmp(str, "none")) affinity.policy = AffinityPolicy::None;
+    else if (!strcmp(str, "compact")) affinity.policy = AffinityPolicy::Compact;
+    else if (!strcmp(str, "scatter")) affinity.policy = AffinityPolicy::Scatter;
+    else if (!strcmp(str, "nosmt")) affinity.policy = AffinityPolicy::NoSMT;
+    else
+    {
+        if (strspn(str, "0123456789-,") != strlen(str)) return false;
+        affinity.policy = AffinityPolicy::List;
+        affinity.cpus = parseCpuList(str);
+        return !affinity.cpus.empty();
+    }
+    return true;
+}
+
+std::vector<int> threadCpus(int numThreads, const Affinity& affinity)
+{
+    // Rank of each CPU among the SMT siblings of its core, and of its core within its node
+    struct Slot
+    {
+        int id;
+        int node;
+        int coreRank;
+        int siblingRank;
+    };
+    std::vector<Slot> slots;
+    const std::vector<Cpu>& all = cpus();
+    int coreRank = -1;
+    for (size_t i = 0; i < all.size(); ++i)
+    {
+        bool newNode = !i || all[i].node != all[i - 1].node;
+        bool newCore = newNode || all[i].core != all[i - 1].core;
+        coreRank = newNode ? 0 : coreRank + newCore;
+        int siblingRank = newCore ? 0 : slots.back().siblingRank + 1;
+        slots.push_back({ all[i].id, all[i].node, coreRank, siblingRank });
+    }
+
+    // The CPUs are already in the compact order
+    if (affinity.policy == AffinityPolicy::Scatter)
+    {
+        std::stable_sort(slots.begin(), slots.end(), [](const Slot& a, const Slot& b)
+        {
+            if (a.siblingRank != b.siblingRank) return a.siblingRank < b.siblingRank;
+            return a.coreRank < b.coreRank;
+        });
+    }
+    else if (affinity.policy == AffinityPolicy::NoSMT)
+    {
+        std::stable_sort(slots.begin(), slots.end(), [](const Slot& a, const Slot& b) { return a.siblingRank < b.siblingRank; });
+    }
+
+    std::vector<int> order;
+    if (affinity.policy == AffinityPolicy::List)
+    {
+        order = affinity.cpus;
+    }
+    else if (affinity.policy != AffinityPolicy::None)
+    {
+        for (const Slot& slot : slots)
+        {
+            order.push_back(slot.id);
+        }
+    }
+
+    std::vector<int> result(numThreads, -1);
+    for (int i = 0; i < numThreads && !order.empty(); ++i)
+    {
+        result[i] = order[i % order.size()];
+    }
+    return result;
+}
+
+bool pinThreadToCpu(int cpu)
+{
+#ifdef _WIN32
+    GROUP_AFFINITY affinity = {};
+    affinity.Group = static_cast<WORD>(cpu / 64);
+    affinity.Mask = 1ULL << (cpu % 64);
+    return SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr) != 0;
+#else
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#endif
+}
+
+bool pinThreadToNode(int node)
+{
+    const NumaNode& n = numaNodes()[node];
+
+#ifdef _WIN32
+    GROUP_AFFINITY affinity = {};
+    affinity.Group = static_cast<WORD>(n.cpus[0] / 64);
+    for (int cpu : n.cpus)
+    {
+        if (cpu / 64 == affinity.Group) affinity.Mask |= (1ULL << (cpu % 64));
+    }
+    return SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr) != 0;
+#else
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : n.cpus)
+    {
+        CPU_SET(cpu, &set);
+    }
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#endif
+}
+
+#ifndef _WIN32
+static bool mbind(void* ptr, size_t size, int mode, const std::vector<int>& nodeIds)
+{
+    unsigned long mask[16] = {}; // Up to 1024 nodes
+    for (int id : nodeIds)
+    {
+        mask[id / 64] |= (1UL << (id % 64));
+    }
+    return syscall(SYS_mbind, ptr, size, mode, mask, sizeof(mask) * 8, 0) == 0;
+}
+#endif
+
+#ifdef _WIN32
+// Committed pages that were never touched can be decommitted and committed again with a preferred
+// node. Large pages and mapped views can't be decommitted, so for them this fails.
+static bool commitOnNode(void* ptr, size_t size, int nodeId)
+{
+    if (!VirtualFree(ptr, size, MEM_DECOMMIT)) return false;
+    if (VirtualAllocExNuma(GetCurrentProcess(), ptr, size, MEM_COMMIT, PAGE_READWRITE, static_cast<DWORD>(nodeId))) return true;
+
+    // Never leave the range without memory behind it
+    VirtualAlloc(ptr, size, MEM_COMMIT, PAGE_READWRITE);
+    return false;
+}
+#endif
+
+bool bindMemoryToNode(void* ptr, size_t size, int node)
+{
+#ifdef _WIN32
+    return commitOnNode(ptr, size, numaNodes()[node].id);
+#else
+    return mbind(ptr, size, MPOL_BIND, { numaNodes()[node].id });
+#endif
+}
+
+bool interleaveMemory(void* ptr, size_t size)
+{
+#ifdef _WIN32
+    // Round robin over the nodes in 64 kB steps, which keeps the number of calls reasonable
+    constexpr size_t Step = 64 * 1024;
+    const std::vector<NumaNode>& nodes = numaNodes();
+    char* p = static_cast<char*>(ptr);
+    bool success = true;
+    for (size_t offset = 0, i = 0; offset < size && success; offset += Step, ++i)
+    {
+        size_t length = size - offset < Step ? size - offset : Step;
+        success = commitOnNode(p + offset, length, nodes[i % nodes.size()].id);
+    }
+    return success;
+#else
+    std::vector<int> ids;
+    for (const NumaNode& node : numaNodes())
+    {
+        ids.push_back(node.id);
+    }
+    return mbind(ptr, size, MPOL_INTERLEAVE, ids);
+#endif
+}
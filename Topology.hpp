@@ -0,0 +1,65 @@
+// Copyright 2022 Samuel Siltanen
+// Topology.hpp
+
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+enum class NumaPolicy
+{
+    None,       // Pages go wherever they are first touched
+    Interleave, // Pages are spread round robin over the nodes
+    Partition   // Each node owns a contiguous slice
+};
+
+struct NumaNode
+{
+    int id;
+    std::vector<int> cpus;
+};
+
+enum class AffinityPolicy
+{
+    None,       // Threads float, unless the NUMA policy pins them to nodes
+    Compact,    // Fill the SMT siblings of a core, then the cores of a node, then the next node
+    Scatter,    // Round robin over the nodes, one thread per core before the siblings
+    NoSMT,      // One thread per core in node order, the siblings only when the cores run out
+    List        // Explicit list of CPUs
+};
+
+struct Affinity
+{
+    AffinityPolicy policy;
+    std::vector<int> cpus;  // For List
+};
+
+struct Cpu
+{
+    int id;
+    int core;   // CPUs with the same core are SMT siblings
+    int node;   // Index into numaNodes()
+};
+
+// NUMA nodes and their CPUs. Machines without NUMA report a single node with all CPUs.
+const std::vector<NumaNode>& numaNodes();
+
+// All CPUs ordered by node, core and id
+const std::vector<Cpu>& cpus();
+
+// Parse none, compact, scatter, nosmt or a CPU list such as 0-7,16-23
+bool parseAffinity(const char* str, Affinity& affinity);
+
+// The CPU of each thread, or -1 for threads that are not pinned to a CPU
+std::vector<int> threadCpus(int numThreads, const Affinity& affinity);
+
+// Pin the calling thread to the CPUs of a node (index into numaNodes())
+bool pinThreadToNode(int node);
+
+// Pin the calling thread to a single CPU
+bool pinThreadToCpu(int cpu);
+
+// Memory placement policies. These must be applied before the pages are touched, and the
+// range must start on a page boundary. Large pages can't be placed on Windows.
+bool bindMemoryToNode(void* ptr, size_t size, int node);
+bool interleaveMemory(void* ptr, size_t size);
@@ -0,0 +1,124 @@
+// Copyright 2022 Samuel Siltanen
+// Trace.cpp
+
+#include "Trace.hpp"
+
+#include <cinttypes>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+constexpr uint64_t TraceRingSize = 1 << 16; // Events kept for each thread
+
+struct TraceRing
+{
+    int threadIndex;
+    uint64_t written;
+    uint32_t countdown;
+    std::vector<TraceEvent> events;
+};
+
+bool traceEnabled = false;
+
+static uint32_t traceSampleRate = 1;
+static std::chrono::steady_clock::time_point traceStart;
+static thread_local TraceRing* traceRing = nullptr;
+
+// The rings are kept after their threads exit, until the trace is written
+static std::mutex traceMutex;
+static std::vector<TraceRing*> traceRings;
+
+void startTrace(uint32_t sampleRate)
+{
+    traceEnabled = true;
+    traceSampleRate = sampleRate ? sampleRate : 1;
+    traceStart = std::chrono::steady_clock::now();
+}
+
+void registerTraceThread(int threadIndex)
+{
+    TraceRing* ring = new TraceRing;
+    ring->threadIndex = threadIndex;
+    ring->written = 0;
+    ring->countdown = 0;
+    ring->events.resize(TraceRingSize);
+    {
+        std::lock_guard<std::mutex> lock(traceMutex);
+        traceRings.push_back(ring);
+    }
+    traceRing = ring;
+}
+
+bool traceSample()
+{
+    TraceRing* ring = traceRing;
+    if (!ring) return false;
+
+    if (ring->countdown)
+    {
+        ring->countdown--;
+        return false;
+    }
+    ring->countdown = traceSampleRate - 1;
+    return true;
+}
+
+static uint64_t sinceStart(std::chrono::steady_clock::time_point time)
+{
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(time - traceStart).count());
+}
+
+void traceEvent(TraceKind kind, std::chrono::steady_clock::time_point start, int depth, uint64_t hash, uint64_t nodes)
+{
+    TraceRing* ring = traceRing;
+    TraceEvent& event = ring->events[ring->written++ & (TraceRingSize - 1)];
+    event.start = sinceStart(start);
+    event.end = sinceStart(std::chrono::steady_clock::now());
+    event.hash = hash;
+    event.nodes = nodes;
+    event.depth = static_cast<int16_t>(depth);
+    event.kind = kind;
+}
+
+bool writeTrace(const char* path)
+{
+    FILE* file = nullptr;
+    errno_t err = fopen_s(&file, path, "w");
+    if (err || !file)
+    {
+        printf("Can't write the trace to %s\n", path);
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(traceMutex);
+
+    uint64_t events = 0;
+    uint64_t dropped = 0;
+    const char* separator = "\n";
+    fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+    for (TraceRing* ring : traceRings)
+    {
+        fprintf(file, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"Worker %d\"}}",
+            separator, ring->threadIndex, ring->threadIndex);
+        separator = ",\n";
+
+        uint64_t first = ring->written > TraceRingSize ? ring->written - TraceRingSize : 0;
+        for (uint64_t i = first; i < ring->written; i++)
+        {
+            const TraceEvent& event = ring->events[i & (TraceRingSize - 1)];
+            fprintf(file, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, "
+                "\"args\": {\"depth\": %d, \"hash\": \"%016" PRIx64 "\", \"nodes\": %" PRIu64 "}}",
+                event.kind == TraceKind::Item ? "item" : "wait", ring->threadIndex,
+                event.start * 1e-3, (event.end - event.start) * 1e-3, event.depth, event.hash, event.nodes);
+        }
+        events += ring->written - first;
+        dropped += first;
+        delete ring;
+    }
+    traceRings.clear();
+    fprintf(file, "\n]}\n");
+    fclose(file);
+
+    printf("Trace: %" PRIu64 " events written to %s, %" PRIu64 " older ones dropped\n", events, path, dropped);
+    return true;
+}
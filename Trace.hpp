@@ -0,0 +1,39 @@
+// Copyright 2022 Samuel Siltanen
+// Trace.hpp
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+enum class TraceKind : uint8_t
+{
+    Item,   // A work item, from taking it to its result
+    Wait    // Waiting for the stolen items of a split
+};
+
+struct TraceEvent
+{
+    uint64_t start; // Nanoseconds since the trace started
+    uint64_t end;
+    uint64_t hash;
+    uint64_t nodes;
+    int16_t depth;
+    TraceKind kind;
+};
+
+// Set before the workers start, read only after
+extern bool traceEnabled;
+
+// Record 1 of every sampleRate events of each thread
+void startTrace(uint32_t sampleRate);
+
+// Each thread records into a ring buffer of its own, so recording takes no locks. When the ring
+// is full, the oldest events go.
+void registerTraceThread(int threadIndex);
+bool traceSample();
+void traceEvent(TraceKind kind, std::chrono::steady_clock::time_point start, int depth, uint64_t hash, uint64_t nodes);
+
+// Chrome trace event JSON, which Perfetto and chrome://tracing open. Call after the threads
+// that recorded have stopped.
+bool writeTrace(const char* path);
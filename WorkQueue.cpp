@@ -4,103 +4,113 @@
 #include "WorkQueue.hpp"
 #include <cassert>
 #include <malloc.h>
+#include <cstring>
+
+// The memory orders follow Lê et al., "Correct and Efficient Work-Stealing for Weak Memory Models"
 
 WorkQueue::WorkQueue(size_t size)
     : m_front(0)
     , m_back(0)
-    , m_size(size)
-    , m_elements(0)
 {
-    m_buffer = static_cast<WorkItem*>(_aligned_malloc(size * sizeof(WorkItem), alignof(WorkItem)));
+    assert(size && !(size & (size - 1)));
+    m_buffer = allocateBuffer(static_cast<int64_t>(size));
 }
 
 WorkQueue::~WorkQueue()
 {
-    if (m_buffer)
+    for (Buffer* buffer : m_buffers)
     {
-        _aligned_free(m_buffer);
-        m_buffer = nullptr;
+        _aligned_free(buffer->items);
+        delete buffer;
     }
 }
 
-void WorkQueue::push_back(const WorkItem& item)
+WorkQueue::Buffer* WorkQueue::allocateBuffer(int64_t size)
 {
-    m_lock.lock();    
-    m_buffer[m_back] = item;
-    m_buffer[m_back].result->workLeft++;
-    m_back = (m_back + 1) % m_size;
-    m_elements++;
-    assert(m_elements <= m_size);
-    m_lock.unlock();
+    Buffer* buffer = new Buffer;
+    buffer->mask = size - 1;
+    buffer->items = static_cast<WorkItem*>(_aligned_malloc(size * sizeof(WorkItem), alignof(WorkItem)));
+
+    // Touch the buffer here, so that it is placed on the node of the owning thread
+    memset(buffer->items, 0, size * sizeof(WorkItem));
+
+    m_buffers.push_back(buffer);
+    return buffer;
 }
 
-void WorkQueue::push_front(const WorkItem& item)
+WorkQueue::Buffer* WorkQueue::grow(Buffer* buffer, int64_t back, int64_t front)
 {
-    m_lock.lock();
-    push_front_unsafe(item);
-    m_lock.unlock();
+    Buffer* bigger = allocateBuffer(2 * (buffer->mask + 1));
+    for (int64_t i = back; i < front; ++i)
+    {
+        (*bigger)[i] = (*buffer)[i];
+    }
+    m_buffer.store(bigger, std::memory_order_release);
+    return bigger;
 }
 
-void WorkQueue::push_front_unsafe(const WorkItem& item)
+void WorkQueue::push_front(const WorkItem& item)
 {
-    m_front = (m_front + m_size - 1) % m_size;
-    m_buffer[m_front] = item;
-    m_buffer[m_front].result->workLeft++;
-    m_elements++;
-    assert(m_elements <= m_size);
-}
+    int64_t front = m_front.load(std::memory_order_relaxed);
+    int64_t back = m_back.load(std::memory_order_acquire);
+    Buffer* buffer = m_buffer.load(std::memory_order_relaxed);
 
-bool WorkQueue::try_pop_front(WorkItem& item)
-{    
-    m_lock.lock();
-    assert(m_elements >= 0);
-    if (m_elements == 0)
+    if (front - back > buffer->mask)
     {
-        m_lock.unlock();
-        return false;
+        buffer = grow(buffer, back, front);
     }
-    item = m_buffer[m_front];
-    m_front = (m_front + 1) % m_size;
-    m_elements--;
-    m_lock.unlock();
-    return true;
+
+    item.result->workLeft++;
+    (*buffer)[front] = item;
+    m_front.store(front + 1, std::memory_order_release);
 }
 
-bool WorkQueue::try_pop_front(WorkItem& item, size_t marker)
+bool WorkQueue::try_pop_front(WorkItem& item)
 {
-    m_lock.lock();
-    assert(m_elements >= 0);
-    if (m_elements == 0)
+    return try_pop_front(item, INT64_MIN);
+}
+
+bool WorkQueue::try_pop_front(WorkItem& item, int64_t marker)
+{
+    int64_t front = m_front.load(std::memory_order_relaxed) - 1;
+    if (front < marker) return false;
+
+    Buffer* buffer = m_buffer.load(std::memory_order_relaxed);
+    m_front.store(front, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t back = m_back.load(std::memory_order_relaxed);
+
+    if (back > front)
     {
-        m_lock.unlock();
+        // Empty, everything was stolen
+        m_front.store(front + 1, std::memory_order_relaxed);
         return false;
     }
-    
-    if (((marker <= m_back) && (m_front >= marker) && (m_front < m_back)) ||
-        ((m_back < marker) && ((m_front >= marker) || (m_front < m_back))))
+
+    item = (*buffer)[front];
+    if (back == front)
     {
-        m_lock.unlock();
-        return false;
+        // The last item, race against the thieves for it
+        bool won = m_back.compare_exchange_strong(back, back + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+        m_front.store(front + 1, std::memory_order_relaxed);
+        return won;
     }
-
-    item = m_buffer[m_front];
-    m_front = (m_front + 1) % m_size;
-    m_elements--;
-    m_lock.unlock();
     return true;
 }
 
-void WorkQueue::lock()
+// The item is copied before the claim, so a copy made while the owner was overwriting the slot
+// is thrown away with the failed exchange
+bool WorkQueue::try_steal_back(WorkItem& item, bool* lost)
 {
-    m_lock.lock();
-}
+    int64_t back = m_back.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t front = m_front.load(std::memory_order_acquire);
 
-void WorkQueue::unlock()
-{
-    m_lock.unlock();
-}
+    if (back >= front) return false;
 
-size_t WorkQueue::marker()
-{
-    return m_front;
+    Buffer* buffer = m_buffer.load(std::memory_order_acquire);
+    item = (*buffer)[back];
+    bool won = m_back.compare_exchange_strong(back, back + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+    if (lost) *lost = !won;
+    return won;
 }
@@ -3,25 +3,36 @@
 
 #pragma once
 
-#include <mutex>
 #include <atomic>
+#include <cstdint>
+#include <vector>
 
 #include "ChessTypes.hpp"
+#include "Make.hpp"
 
 struct WorkResult
 {
     std::atomic<uint64_t> count;
-    std::atomic<int> workLeft;
+    std::atomic<int> workLeft;  // Has a flag bit set while the owner of the split is parked
+    std::atomic<uint64_t> thieves; // Bit (worker index % 64) set while a worker runs an item of this split
 };
 
-struct alignas(64) WorkItem
+// Whoever runs the item makes its position from the parent. The parent stays put until all the
+// items of its split are done. A default move means the parent itself.
+struct WorkItem
 {
-    Position pos;
-    int depth;
-
+    const Position* parent;
     WorkResult* result;
+    Move move;
+    int16_t depth;
+    uint32_t multiplicity; // The count is added this many times, for the merged transpositions of the root frontier
+
+    Position position() const { return move.packed ? make(*parent, move) : *parent; }
 };
 
+// Lock-free work stealing deque (Chase-Lev). The owning thread pushes and pops at the front,
+// so it works depth first on its latest split, and the other threads steal from the back, where
+// the oldest and largest subtrees are. The buffer grows when the owner runs out of room.
 class WorkQueue
 {
 public:
@@ -33,23 +44,36 @@ public:
     const WorkQueue& operator=(WorkQueue&) = delete;
     const WorkQueue& operator=(WorkQueue&&) = delete;
 
-    void push_back(const WorkItem& item);
+    // Only for the owner, or for another thread while the owner is not running
     void push_front(const WorkItem& item);
-    void push_front_unsafe(const WorkItem& item);
-
     bool try_pop_front(WorkItem& item);
-    bool try_pop_front(WorkItem& item, size_t marker);
 
-    void lock();
-    void unlock();
+    // Pops only items pushed after the marker was taken, which are the owner's current split
+    bool try_pop_front(WorkItem& item, int64_t marker);
+    int64_t marker() const { return m_front.load(std::memory_order_relaxed); }
+
+    // Only for the owner. Thieves may empty the queue any time after.
+    bool empty() const { return m_front.load(std::memory_order_relaxed) <= m_back.load(std::memory_order_relaxed); }
 
-    size_t marker();
+    // For the other threads. Sets lost when there was an item, but someone else got it first.
+    bool try_steal_back(WorkItem& item, bool* lost = nullptr);
 private:
-    WorkItem* m_buffer;
-    size_t m_front;
-    size_t m_back;
-    size_t m_size;
-    size_t m_elements;
+    struct Buffer
+    {
+        int64_t mask;
+        WorkItem* items;
+
+        WorkItem& operator[](int64_t index) { return items[index & mask]; }
+    };
+
+    Buffer* allocateBuffer(int64_t size);
+    Buffer* grow(Buffer* buffer, int64_t back, int64_t front);
+
+    // The items are at [back, front). Stealing moves the back forward, and it never comes back.
+    alignas(64) std::atomic<int64_t> m_front;
+    alignas(64) std::atomic<int64_t> m_back;
+    std::atomic<Buffer*> m_buffer;
 
-    std::mutex m_lock;
+    // Thieves may still read the replaced buffers, so they are freed with the queue
+    std::vector<Buffer*> m_buffers;
 };